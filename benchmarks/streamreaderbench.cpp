@@ -0,0 +1,323 @@
+/*  This file is part of the KDE project.
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2.1 or 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Drives the StreamReader with a synthetic AbstractMediaStream into
+ * appsrc ! fakesink and reports throughput and latency, e.g.
+ *
+ *     streamreaderbench --size 268435456 --chunk 4096 --seekable --seek probe
+ *
+ * Non-seekable streams exercise push mode, seekable ones the pull path
+ * including the seek-range cache.
+ */
+
+#include "streamreader.h"
+
+#include <phonon/AbstractMediaStream>
+#include <phonon/MediaSource>
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QTimer>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace Phonon::Gstreamer;
+
+/*
+ * Answers every needData() with one freshly allocated chunk, optionally after
+ * a delay to mimic a slow network or disk.
+ */
+class MockStream : public Phonon::AbstractMediaStream
+{
+    Q_OBJECT
+public:
+    MockStream(qint64 size, int chunkSize, int delay, bool seekable)
+        : m_size(size)
+        , m_chunkSize(chunkSize)
+        , m_delay(delay)
+        , m_pos(0)
+        , m_pending(false)
+    {
+        setStreamSize(size);
+        setStreamSeekable(seekable);
+    }
+
+    int needDataCalls() const { return m_needDataCalls.loadAcquire(); }
+    int seekCalls() const { return m_seekCalls.loadAcquire(); }
+
+protected:
+    void reset() Q_DECL_OVERRIDE
+    {
+        m_pos = 0;
+    }
+
+    void needData() Q_DECL_OVERRIDE
+    {
+        m_needDataCalls.ref();
+        if (m_delay > 0) {
+            // The StreamEventQueue marshals needData() over to the thread
+            // this stream lives in, so the timer can be started right here.
+            scheduleProduce();
+        } else {
+            produce();
+        }
+    }
+
+    void seekStream(qint64 offset) Q_DECL_OVERRIDE
+    {
+        m_seekCalls.ref();
+        m_pos = offset;
+    }
+
+private Q_SLOTS:
+    void scheduleProduce()
+    {
+        if (!m_pending) {
+            m_pending = true;
+            QTimer::singleShot(m_delay, this, SLOT(produce()));
+        }
+    }
+
+    void produce()
+    {
+        m_pending = false;
+        if (m_pos >= m_size) {
+            endOfData();
+            return;
+        }
+        const int size = qMin<qint64>(m_chunkSize, m_size - m_pos);
+        m_pos += size;
+        writeData(QByteArray(size, Qt::Uninitialized));
+    }
+
+private:
+    const qint64 m_size;
+    const int m_chunkSize;
+    const int m_delay;
+    qint64 m_pos;
+    bool m_pending;
+    QAtomicInt m_needDataCalls;
+    QAtomicInt m_seekCalls;
+};
+
+struct SinkStats
+{
+    QElapsedTimer clock;
+    QAtomicInteger<qint64> bytes;
+    QAtomicInteger<qint64> buffers;
+    QAtomicInteger<qint64> firstBuffer;
+};
+
+static void cb_handoff(GstElement *sink, GstBuffer *buffer, GstPad *pad, gpointer data)
+{
+    Q_UNUSED(sink);
+    Q_UNUSED(pad);
+    SinkStats *stats = static_cast<SinkStats*>(data);
+    stats->firstBuffer.testAndSetOrdered(-1, stats->clock.nsecsElapsed());
+    stats->bytes.fetchAndAddRelaxed(gst_buffer_get_size(buffer));
+    stats->buffers.fetchAndAddRelaxed(1);
+}
+
+class Benchmark : public QObject
+{
+    Q_OBJECT
+public:
+    Benchmark(MockStream *stream, const QString &seekPattern, int seekInterval, int seeks)
+        : m_stream(stream)
+        , m_source(stream)
+        , m_reader(m_source)
+        , m_pipeline(0)
+        , m_seekPattern(seekPattern)
+        , m_seeks(seeks)
+        , m_seekCount(0)
+    {
+        m_stats.bytes = 0;
+        m_stats.buffers = 0;
+        m_stats.firstBuffer = -1;
+        m_seekTimer.setInterval(seekInterval);
+        connect(&m_seekTimer, SIGNAL(timeout()), this, SLOT(seek()));
+        m_busTimer.setInterval(10);
+        connect(&m_busTimer, SIGNAL(timeout()), this, SLOT(pollBus()));
+    }
+
+    ~Benchmark()
+    {
+        if (m_pipeline) {
+            gst_element_set_state(m_pipeline, GST_STATE_NULL);
+            gst_object_unref(m_pipeline);
+        }
+    }
+
+    bool start()
+    {
+        GError *err = 0;
+        m_pipeline = gst_parse_launch("appsrc name=src format=bytes ! "
+                                      "fakesink name=sink sync=false signal-handoffs=true", &err);
+        if (!m_pipeline) {
+            fprintf(stderr, "Could not create pipeline: %s\n", err->message);
+            g_error_free(err);
+            return false;
+        }
+        GstElement *src = gst_bin_get_by_name(GST_BIN(m_pipeline), "src");
+        GstElement *sink = gst_bin_get_by_name(GST_BIN(m_pipeline), "sink");
+        m_reader.start();
+        m_reader.setupAppSrc(GST_APP_SRC(src));
+        g_signal_connect(sink, "handoff", G_CALLBACK(cb_handoff), &m_stats);
+        gst_object_unref(src);
+        gst_object_unref(sink);
+
+        m_stats.clock.start();
+        gst_element_set_state(m_pipeline, GST_STATE_PLAYING);
+        m_busTimer.start();
+        if (m_reader.streamSeekable() && m_seekPattern != QLatin1String("none") && m_seeks > 0) {
+            m_seekTimer.start();
+        }
+        return true;
+    }
+
+    void report()
+    {
+        const qint64 elapsed = m_stats.clock.nsecsElapsed();
+        const double seconds = elapsed / 1e9;
+        const qint64 bytes = m_stats.bytes.loadAcquire();
+        const qint64 firstBuffer = m_stats.firstBuffer.loadAcquire();
+        printf("mode:                   %s\n", m_reader.isPushMode() ? "push" : "pull");
+        printf("bytes:                  %lld in %lld buffers\n",
+               (long long) bytes, (long long) m_stats.buffers.loadAcquire());
+        printf("elapsed:                %.3f s\n", seconds);
+        printf("throughput:             %.2f MB/s\n", seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0);
+        printf("time to first buffer:   %.3f ms\n", firstBuffer < 0 ? -1.0 : firstBuffer / 1e6);
+        printf("need-data round-trips:  %d (%llu requested by the reader)\n",
+               m_stream->needDataCalls(), (unsigned long long) m_reader.dataRequests());
+        printf("lock wait:              %.3f ms\n", m_reader.lockWaitTime() / 1e6);
+        printf("data wait:              %.3f ms\n", m_reader.dataWaitTime() / 1e6);
+        printf("seeks:                  %d issued, %d reached the stream\n", m_seekCount, m_stream->seekCalls());
+        printf("cache hits/misses:      %llu/%llu\n",
+               (unsigned long long) m_reader.cacheHits(), (unsigned long long) m_reader.cacheMisses());
+    }
+
+private Q_SLOTS:
+    void seek()
+    {
+        const qint64 size = m_reader.streamSize();
+        qint64 offset = 0;
+        if (m_seekPattern == QLatin1String("random")) {
+            offset = qint64(double(rand()) / RAND_MAX * size);
+        } else if (m_seekPattern == QLatin1String("probe")) {
+            // What demuxers do for files with the index at the end: jump to
+            // the tail, read it and come back.
+            offset = (m_seekCount % 2 == 0) ? qMax<qint64>(size - 64 * 1024, 0) : 0;
+        }
+        ++m_seekCount;
+        if (m_seekCount >= m_seeks) {
+            m_seekTimer.stop();
+        }
+        gst_element_seek_simple(m_pipeline, GST_FORMAT_BYTES, GST_SEEK_FLAG_FLUSH, offset);
+    }
+
+    void pollBus()
+    {
+        GstBus *bus = gst_element_get_bus(m_pipeline);
+        while (GstMessage *msg = gst_bus_pop_filtered(bus, GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR))) {
+            if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+                GError *err = 0;
+                gst_message_parse_error(msg, &err, 0);
+                fprintf(stderr, "Error: %s\n", err->message);
+                g_error_free(err);
+            }
+            gst_message_unref(msg);
+            finish();
+        }
+        gst_object_unref(bus);
+    }
+
+private:
+    void finish()
+    {
+        m_busTimer.stop();
+        m_seekTimer.stop();
+        report();
+        m_reader.stop();
+        gst_element_set_state(m_pipeline, GST_STATE_NULL);
+        QCoreApplication::quit();
+    }
+
+    MockStream *m_stream;
+    Phonon::MediaSource m_source;
+    StreamReader m_reader;
+    GstElement *m_pipeline;
+    SinkStats m_stats;
+    QTimer m_seekTimer;
+    QTimer m_busTimer;
+    const QString m_seekPattern;
+    const int m_seeks;
+    int m_seekCount;
+};
+
+int main(int argc, char **argv)
+{
+    gst_init(&argc, &argv);
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("StreamReader/appsrc throughput and latency benchmark"));
+    parser.addHelpOption();
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Stream size in bytes."), QStringLiteral("bytes"), QStringLiteral("67108864"));
+    QCommandLineOption chunkOption(QStringLiteral("chunk"), QStringLiteral("Bytes written per needData()."), QStringLiteral("bytes"), QStringLiteral("4096"));
+    QCommandLineOption delayOption(QStringLiteral("delay"), QStringLiteral("Delay before answering needData()."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption seekableOption(QStringLiteral("seekable"), QStringLiteral("Make the stream seekable (pull mode), otherwise it is pushed."));
+    QCommandLineOption seekOption(QStringLiteral("seek"), QStringLiteral("Seek pattern: none, random or probe."), QStringLiteral("pattern"), QStringLiteral("none"));
+    QCommandLineOption intervalOption(QStringLiteral("seek-interval"), QStringLiteral("Time between seeks."), QStringLiteral("ms"), QStringLiteral("50"));
+    QCommandLineOption seeksOption(QStringLiteral("seeks"), QStringLiteral("Number of seeks to issue."), QStringLiteral("count"), QStringLiteral("20"));
+    parser.addOption(sizeOption);
+    parser.addOption(chunkOption);
+    parser.addOption(delayOption);
+    parser.addOption(seekableOption);
+    parser.addOption(seekOption);
+    parser.addOption(intervalOption);
+    parser.addOption(seeksOption);
+    parser.process(app);
+
+    const QString seekPattern = parser.value(seekOption);
+    if (seekPattern != QLatin1String("none") && seekPattern != QLatin1String("random") &&
+        seekPattern != QLatin1String("probe")) {
+        fprintf(stderr, "Unknown seek pattern %s\n", qPrintable(seekPattern));
+        return 1;
+    }
+
+    MockStream *stream = new MockStream(parser.value(sizeOption).toLongLong(),
+                                        qMax(parser.value(chunkOption).toInt(), 1),
+                                        parser.value(delayOption).toInt(),
+                                        parser.isSet(seekableOption));
+    stream->setParent(&app);
+    Benchmark benchmark(stream, seekPattern,
+                        parser.value(intervalOption).toInt(),
+                        parser.value(seeksOption).toInt());
+    if (!benchmark.start()) {
+        return 1;
+    }
+    return app.exec();
+}
+
+#include "streamreaderbench.moc"
@@ -25,6 +25,7 @@
 #include "audiodataoutput.h"
 #include "gsthelper.h"
 #include "medianode.h"
+#include "threadpolicy.h"
 #include "phonon-config-gstreamer.h"
 #include <QtCore/QVector>
 #include <QtCore/QMap>
@@ -49,6 +50,7 @@ AudioDataOutput::AudioDataOutput(Backend *backend, QObject *parent)
 
     m_queue = gst_bin_new(NULL);
     gst_object_ref_sink(GST_OBJECT(m_queue));
+    ThreadPolicy::tag(m_queue, ThreadPolicy::AnalysisThread);
     GstElement* sink = gst_element_factory_make("fakesink", NULL);
     GstElement* queue = gst_element_factory_make("queue", NULL);
     GstElement* convert = gst_element_factory_make("audioconvert", NULL);
@@ -22,10 +22,12 @@
 #include "devicemanager.h"
 #include "mediaobject.h"
 #include "gsthelper.h"
+#include "threadpolicy.h"
 #include "phonon-config-gstreamer.h"
 #include <phonon/audiooutput.h>
 #include <phonon/pulsesupport.h>
 
+#include <QtCore/QPointer>
 #include <QtCore/QStringBuilder>
 
 #include <gst/gst.h>
@@ -60,6 +62,8 @@ AudioOutput::AudioOutput(Backend *backend, QObject *parent)
     if (Phonon::AudioOutput *audioOutput = qobject_cast<Phonon::AudioOutput *>(parent))
         category = audioOutput->category();
 
+    ThreadPolicy::tagCategory(m_audioBin, category);
+
     m_audioSink = m_backend->deviceManager()->createAudioSink(category);
     gst_object_ref_sink(m_audioSink);
     m_volumeElement = gst_element_factory_make("volume", NULL);
@@ -160,20 +164,33 @@ bool AudioOutput::setOutputDevice(const AudioOutputDevice &newDevice)
         return true;
     }
 
-    if (root()) {
+    if (root() && (root()->pipeline()->state() > GST_STATE_READY ||
+                   root()->pipeline()->pendingState() != GST_STATE_VOID_PENDING)) {
+        // The sink only lets go of its device with the pipeline stopped. The
+        // switch follows once READY got reached, a failure is reported
+        // through audioDeviceFailed().
         root()->saveState();
-        if (root()->pipeline()->setState(GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
-            return false;
-        }
+        const int index = newDevice.index();
+        QPointer<AudioOutput> that(this);
+        root()->pipeline()->requestState(GST_STATE_READY, [that, index, deviceAccessList]() {
+            if (that && !that->switchOutputDevice(index, deviceAccessList)) {
+                emit that->audioDeviceFailed();
+            }
+        });
+        return true;
     }
+    return switchOutputDevice(newDevice.index(), deviceAccessList);
+}
 
+bool AudioOutput::switchOutputDevice(int index, const DeviceAccessList &deviceAccessList)
+{
     // Save previous state
     const GstState oldState = GST_STATE(m_audioSink);
     const QByteArray oldDeviceValue = GstHelper::property(m_audioSink, "device");
 
     foreach (const DeviceAccess &deviceAccess, deviceAccessList) {
         if (setOutputDevice(deviceAccess.first, deviceAccess.second, oldState)) {
-            m_device = newDevice.index();
+            m_device = index;
             return true;
         }
     }
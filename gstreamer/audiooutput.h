@@ -61,6 +61,9 @@ Q_SIGNALS:
 
 private:
     bool setOutputDevice(const QByteArray &, const QString &, const GstState);
+#if (PHONON_VERSION >= PHONON_VERSION_CHECK(4, 2, 0))
+    bool switchOutputDevice(int index, const DeviceAccessList &deviceAccessList);
+#endif
 
 private:
     qreal m_volumeLevel;
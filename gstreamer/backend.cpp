@@ -410,6 +410,10 @@ bool Backend::startConnectionChange(QSet<QObject *> objects)
         MediaObject *media = sourceNode->root();
         if (media) {
             media->saveState();
+            if (!m_graphTransactions.contains(media)) {
+                media->beginGraphTransaction();
+                m_graphTransactions << media;
+            }
         }
     }
     return true;
@@ -453,6 +457,15 @@ bool Backend::disconnectNodes(QObject *source, QObject *sink)
  */
 bool Backend::endConnectionChange(QSet<QObject *> objects)
 {
+    // Nodes may have changed their root in between, so the media objects
+    // the change started on are committed rather than the current roots.
+    foreach (const QPointer<MediaObject> &media, m_graphTransactions) {
+        if (media) {
+            media->commitGraphTransaction();
+        }
+    }
+    m_graphTransactions.clear();
+
     foreach (QObject *object, objects) {
         MediaNode *sourceNode = qobject_cast<MediaNode *>(object);
         MediaObject *media = sourceNode->root();
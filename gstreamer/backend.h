@@ -22,6 +22,7 @@
 #include <phonon/backendinterface.h>
 
 #include <QtCore/QList>
+#include <QtCore/QPointer>
 #include <QtCore/QStringList>
 
 namespace Phonon
@@ -72,6 +73,8 @@ private:
     DeviceManager *m_deviceManager;
     EffectManager *m_effectManager;
     bool m_isValid;
+    // Media objects whose graph is rebuilt once the connection change ends.
+    QList<QPointer<MediaObject> > m_graphTransactions;
 };
 
 }
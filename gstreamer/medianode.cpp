@@ -21,6 +21,11 @@
 #include "debug.h"
 #include "phonon-config-gstreamer.h"
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <functional>
+
 #include <gst/gst.h>
 #include <gst/gstbin.h>
 #include <gst/gstutils.h>
@@ -37,27 +42,37 @@ MediaNode::MediaNode(Backend *backend, NodeDescription description) :
         m_videoTee(0),
         m_backend(backend),
         m_description(description),
-        m_finalized(false)
+        m_finalized(false),
+        m_bypassedQueue(0)
 {
     if ((description & AudioSink) && (description & VideoSink)) {
         Q_ASSERT(0); // A node cannot accept both audio and video
     }
 
+    // Branches get linked and unlinked while data flows, a tee without any
+    // must not stop the stream.
     if (description & AudioSource) {
         m_audioTee = gst_element_factory_make("tee", NULL);
         Q_ASSERT(m_audioTee); // Must not ever be null.
         gst_object_ref_sink(GST_OBJECT(m_audioTee));
+        g_object_set(m_audioTee, "allow-not-linked", TRUE, NULL);
     }
 
     if (description & VideoSource) {
         m_videoTee = gst_element_factory_make("tee", NULL);
         Q_ASSERT(m_videoTee); // Must not ever be null.
         gst_object_ref_sink(GST_OBJECT(m_videoTee));
+        g_object_set(m_videoTee, "allow-not-linked", TRUE, NULL);
     }
 }
 
 MediaNode::~MediaNode()
 {
+    if (m_bypassedQueue) {
+        gst_object_unref(m_bypassedQueue);
+        m_bypassedQueue = 0;
+    }
+
     if (m_videoTee) {
         gst_element_set_state(m_videoTee, GST_STATE_NULL);
         gst_object_unref(m_videoTee);
@@ -109,9 +124,22 @@ bool MediaNode::buildGraph()
         m_finalized = true;
     }
 
+    updateConnectedOutputs();
     return success;
 }
 
+/*
+ * Lets the pipeline skip decoding streams no sink is linked for. Only the
+ * media object at the root of the graph has a say.
+ */
+void MediaNode::updateConnectedOutputs()
+{
+    if (!root() || static_cast<MediaNode*>(root()) != this) {
+        return;
+    }
+    root()->pipeline()->setConnectedOutputs(!m_audioSinkList.isEmpty(), !m_videoSinkList.isEmpty());
+}
+
 /**
  *  Disconnects children recursively
  */
@@ -158,6 +186,12 @@ bool MediaNode::connectNode(QObject *obj)
             return false;
         }
 
+        // Still feeding the graph of a media object it got disconnected
+        // from, which it cannot share with another one.
+        if (sink->m_pendingBreakRoot && sink->m_pendingBreakRoot.data() != root()) {
+            sink->breakPendingGraph();
+        }
+
         if ((m_description & AudioSource) && (sink->m_description & AudioSink)) {
             m_audioSinkList << obj;
             success = true;
@@ -171,57 +205,222 @@ bool MediaNode::connectNode(QObject *obj)
         // If we have a root source, and we are connected
         // try to link the gstreamer elements
         if (success && root()) {
-            root()->buildGraph();
+            root()->requestGraphBuild();
         }
     }
     return success;
 }
 
+#define DRAIN_EVENT "phonon-gst-drain"
+
+struct DrainTask
+{
+    // One for each of the probes holding it.
+    QAtomicInt refs;
+    QMutex lock;
+    Pipeline *pipeline;
+    GstPad *feed;
+    GstPad *queueSink;
+    GstPad *queueSrc;
+    gulong blockId;
+    gulong flushId;
+    gulong drainedId;
+    bool draining;
+    bool finished;
+    std::function<void()> task;
+    std::function<void()> done;
+};
+
+static void cb_drainDestroy(gpointer data)
+{
+    DrainTask *drain = static_cast<DrainTask*>(data);
+    if (drain->refs.deref()) {
+        return;
+    }
+    gst_object_unref(drain->feed);
+    gst_object_unref(drain->queueSink);
+    gst_object_unref(drain->queueSrc);
+    delete drain;
+}
+
+// Called with drain->lock held by whichever of the drain event, a flush or
+// the feed coming back after a state drop gets here first. The queue is
+// empty, or about to be flushed, in all three cases.
+static void finishDrain(DrainTask *drain)
+{
+    drain->finished = true;
+    drain->task();
+    if (drain->drainedId) {
+        gst_pad_remove_probe(drain->queueSrc, drain->drainedId);
+    }
+    gst_pad_remove_probe(drain->feed, drain->flushId);
+    // The feed goes on from the buffer it was blocked at.
+    gst_pad_remove_probe(drain->feed, drain->blockId);
+    drain->pipeline->runInMainThread(drain->done);
+}
+
+// Runs in the streaming thread of the queue, everything that was queued ahead
+// of the drain event has left by the time it comes out.
+static GstPadProbeReturn cb_drained(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    Q_UNUSED(pad);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_DOWNSTREAM || !gst_event_has_name(event, DRAIN_EVENT)) {
+        return GST_PAD_PROBE_OK;
+    }
+    DrainTask *drain = static_cast<DrainTask*>(data);
+    QMutexLocker locker(&drain->lock);
+    if (!drain->finished) {
+        finishDrain(drain);
+    }
+    return GST_PAD_PROBE_DROP;
+}
+
+// A flushing seek empties the queue along with the drain event, there is
+// nothing left to wait for.
+static GstPadProbeReturn cb_drainFlush(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    Q_UNUSED(pad);
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_FLUSH_START) {
+        return GST_PAD_PROBE_OK;
+    }
+    DrainTask *drain = static_cast<DrainTask*>(data);
+    QMutexLocker locker(&drain->lock);
+    if (drain->draining && !drain->finished) {
+        finishDrain(drain);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Runs in the streaming thread feeding the queue, which stays blocked while
+// the queue drains.
+static GstPadProbeReturn cb_drainBlocked(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    Q_UNUSED(pad);
+    DrainTask *drain = static_cast<DrainTask*>(data);
+    QMutexLocker locker(&drain->lock);
+    if (drain->finished) {
+        return GST_PAD_PROBE_OK;
+    }
+    if (drain->draining) {
+        // Only flushing lets go of a blocked pad. Dropping to READY does so
+        // without a flush event and empties the queue along with the drain
+        // event, the first data after coming back finishes up instead.
+        finishDrain(drain);
+        return GST_PAD_PROBE_OK;
+    }
+    drain->draining = true;
+    drain->blockId = GST_PAD_PROBE_INFO_ID(info);
+    drain->refs.ref();
+    drain->drainedId = gst_pad_add_probe(drain->queueSrc, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                                         cb_drained, drain, cb_drainDestroy);
+    locker.unlock();
+    gst_pad_send_event(drain->queueSink, gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM,
+                                                              gst_structure_new_empty(DRAIN_EVENT)));
+    return GST_PAD_PROBE_OK;
+}
+
+// Blocks feed and runs task once everything the queue held went out, so
+// nothing it buffered is lost. done follows in the thread of the pipeline.
+// A flush or a state drop in between empties the queue, task runs right
+// away then.
+static void runWhenDrained(Pipeline *pipeline, GstPad *feed, GstPad *queueSink, GstPad *queueSrc,
+                           const std::function<void()> &task, const std::function<void()> &done)
+{
+    DrainTask *drain = new DrainTask;
+    drain->refs = 2;
+    drain->pipeline = pipeline;
+    drain->feed = GST_PAD(gst_object_ref(feed));
+    drain->queueSink = GST_PAD(gst_object_ref(queueSink));
+    drain->queueSrc = GST_PAD(gst_object_ref(queueSrc));
+    drain->blockId = 0;
+    drain->drainedId = 0;
+    drain->draining = false;
+    drain->finished = false;
+    drain->task = task;
+    drain->done = done;
+    drain->flushId = gst_pad_add_probe(feed, GstPadProbeType(GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+                                                             GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+                                       cb_drainFlush, drain, cb_drainDestroy);
+    gst_pad_add_probe(feed, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM, cb_drainBlocked, drain, cb_drainDestroy);
+}
+
+/*
+ * Takes the branch starting at element off the tee right away, releasing the
+ * tee pad unlinks it and the tee ignores whatever the pad still returns. While
+ * playing the branch is only shut down once the buffer it may still be
+ * handling went through, in the thread of the pipeline, unless it was linked
+ * again by then. then follows right after in the same place.
+ */
+static void removeBranch(Pipeline *pipeline, GstElement *tee, GstElement *element, GstElement *graph, bool hot,
+                         const std::function<void()> &then)
+{
+    GstPad *sinkPad = gst_element_get_static_pad(element, "sink");
+    // Release requested src pad from tee
+    GstPad *requestedPad = gst_pad_get_peer(sinkPad);
+    if (requestedPad) {
+        gst_element_release_request_pad(tee, requestedPad);
+        gst_object_unref(requestedPad);
+    }
+    gst_object_ref(element);
+    gst_object_ref(graph);
+    std::function<void()> release = [element, graph, sinkPad, then]() {
+        // Otherwise addOutput() took the branch over as it is.
+        if (GST_ELEMENT_PARENT(element) == graph && !gst_pad_is_linked(sinkPad)) {
+            gst_element_set_state(element, GST_STATE_NULL);
+            gst_bin_remove(GST_BIN(graph), element);
+        }
+        then();
+        gst_object_unref(sinkPad);
+        gst_object_unref(graph);
+        gst_object_unref(element);
+    };
+    if (hot) {
+        pipeline->runWhenIdle(sinkPad, std::function<void()>(), release);
+    } else {
+        release();
+    }
+}
+
 bool MediaNode::disconnectNode(QObject *obj)
 {
     MediaNode *sink = qobject_cast<MediaNode*>(obj);
     if (root()) {
-        // Disconnecting elements while playing or paused seems to cause
-        // potential deadlock. Hence we force the pipeline into ready state
-        // before any nodes are disconnected.
-        root()->pipeline()->setState(GST_STATE_READY);
+        // A playing branch is guaranteed to get its pad idle once the buffer
+        // in flight went through. When paused a prerolled sink may keep its
+        // pad busy forever, there the branch is shut down right away instead.
+        // Its tee pad is released first, so the tee ignores the flushing the
+        // branch returns and the rest of the pipeline can stay paused.
+        const bool hot = root()->pipeline()->state() == GST_STATE_PLAYING &&
+                         root()->pipeline()->pendingState() == GST_STATE_VOID_PENDING;
 
         Q_ASSERT(sink->root()); //sink has to have a root since it is connected
 
-        if (sink->description() & (AudioSink)) {
-            GstPad *sinkPad = gst_element_get_static_pad(sink->audioElement(), "sink");
-            // Release requested src pad from tee
-            GstPad *requestedPad = gst_pad_get_peer(sinkPad);
-            if (requestedPad) {
-                gst_element_release_request_pad(m_audioTee, requestedPad);
-                gst_object_unref(requestedPad);
-            }
-            if (GST_ELEMENT_PARENT(sink->audioElement())) {
-                gst_bin_remove(GST_BIN(root()->audioGraph()), sink->audioElement());
+        // The sink is free to be connected again from here on, even while
+        // its element is still waiting to be shut down. Whatever it feeds in
+        // turn is shut down along with it, it may still be handling data.
+        sink->m_pendingBreakRoot = root();
+        sink->setRoot(0);
+        QPointer<QObject> guard(obj);
+        std::function<void()> then = [guard]() {
+            if (MediaNode *node = qobject_cast<MediaNode*>(guard.data())) {
+                node->breakPendingGraph();
             }
-            gst_object_unref(sinkPad);
-        }
+        };
 
-        if (sink->description() & (VideoSink)) {
-            GstPad *sinkPad = gst_element_get_static_pad(sink->videoElement(), "sink");
-            // Release requested src pad from tee
-            GstPad *requestedPad = gst_pad_get_peer(sinkPad);
-            if (requestedPad) {
-                gst_element_release_request_pad(m_videoTee, requestedPad);
-                gst_object_unref(requestedPad);
-            }
-            if (GST_ELEMENT_PARENT(sink->videoElement())) {
-                gst_bin_remove(GST_BIN(root()->videoGraph()), sink->videoElement());
-            }
-            gst_object_unref(sinkPad);
+        Pipeline *pipeline = root()->pipeline();
+        if (sink->description() & (AudioSink)) {
+            removeBranch(pipeline, m_audioTee, sink->audioElement(), root()->audioGraph(), hot, then);
+        } else if (sink->description() & (VideoSink)) {
+            removeBranch(pipeline, m_videoTee, sink->videoElement(), root()->videoGraph(), hot, then);
+        } else {
+            sink->breakPendingGraph();
         }
-
-        sink->breakGraph();
-        sink->setRoot(0);
     }
 
     m_videoSinkList.removeAll(obj);
     m_audioSinkList.removeAll(obj);
+    updateConnectedOutputs();
 
     if (sink->m_description & AudioSink) {
         // Remove sink from graph
@@ -236,6 +435,32 @@ bool MediaNode::disconnectNode(QObject *obj)
     return false;
 }
 
+/*
+ * Breaks the graph behind a node that got disconnected, once its branch
+ * went idle. If it was connected to the same media object again by then,
+ * its graph is taken over as it is instead.
+ */
+void MediaNode::breakPendingGraph()
+{
+    MediaObject *pendingRoot = qobject_cast<MediaObject*>(m_pendingBreakRoot.data());
+    m_pendingBreakRoot.clear();
+    if (!pendingRoot || root()) {
+        return;
+    }
+    setRoot(pendingRoot);
+    breakGraph();
+    setRoot(0);
+}
+
+// Holds data back from a tee pad while its branch comes up.
+static GstPadProbeReturn cb_blockBranch(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    Q_UNUSED(pad);
+    Q_UNUSED(info);
+    Q_UNUSED(data);
+    return GST_PAD_PROBE_OK;
+}
+
 /*
  * Requests a new tee pad and connects a node to it
  */
@@ -258,7 +483,6 @@ bool MediaNode::addOutput(MediaNode *output, GstElement *tee)
         return false;
     }
 
-    GstState state = root()->pipeline()->state();
     GstPadTemplate* tee_src_pad_template = gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS (tee), "src_%u");
     GstPad *srcPad = gst_element_request_pad(tee, tee_src_pad_template, NULL, NULL);
     GstPad *sinkPad = gst_element_get_static_pad(sinkElement, "sink");
@@ -267,21 +491,36 @@ bool MediaNode::addOutput(MediaNode *output, GstElement *tee)
         success = false;
     } else if (gst_pad_is_linked(sinkPad)) {
         gst_object_unref(GST_OBJECT(sinkPad));
+        gst_element_release_request_pad(tee, srcPad);
         gst_object_unref(GST_OBJECT(srcPad));
         return true;
     }
 
     if (success) {
-        if (output->description() & AudioSink) {
-            gst_bin_add(GST_BIN(root()->audioGraph()), sinkElement);
-        } else if (output->description() & VideoSink) {
-            gst_bin_add(GST_BIN(root()->videoGraph()), sinkElement);
+        GstElement *graph = (output->description() & AudioSink) ? root()->audioGraph() : root()->videoGraph();
+        GstObject *parent = GST_ELEMENT_PARENT(sinkElement);
+        // Still around from a disconnect waiting for its branch to go idle,
+        // see removeBranch(). Taken back as it is if it was ours.
+        if (parent && parent != GST_OBJECT(graph)) {
+            gst_element_set_state(sinkElement, GST_STATE_NULL);
+            gst_bin_remove(GST_BIN(parent), sinkElement);
+            parent = 0;
+        }
+        if (!parent) {
+            gst_bin_add(GST_BIN(graph), sinkElement);
         }
     }
 
     if (success) {
+        // Nothing goes out of the new tee pad until the branch is up, its
+        // sink pad would still be flushing and the tee would hand that
+        // upstream. The new tee pad gets the sticky events replayed once
+        // data flows.
+        const gulong blockId = gst_pad_add_probe(srcPad, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
+                                                 cb_blockBranch, NULL, NULL);
         gst_pad_link(srcPad, sinkPad);
-        gst_element_set_state(sinkElement, state);
+        gst_element_sync_state_with_parent(sinkElement);
+        gst_pad_remove_probe(srcPad, blockId);
     } else {
         gst_element_release_request_pad(tee, srcPad);
     }
@@ -301,6 +540,11 @@ bool MediaNode::linkMediaNodeList(QList<QObject *> &list, GstElement *bin, GstEl
         }
         gst_element_set_state(tee, GST_STATE(bin));
     }
+    // Several branches need a thread each again before the tee feeds them.
+    const bool single = list.size() == 1;
+    if (!single) {
+        optimizeBranches(list, false);
+    }
     for (int i = 0 ; i < list.size() ; ++i) {
         QObject *sink = list[i];
         if (MediaNode *output = qobject_cast<MediaNode*>(sink)) {
@@ -309,9 +553,172 @@ bool MediaNode::linkMediaNodeList(QList<QObject *> &list, GstElement *bin, GstEl
             }
         }
     }
+    if (single) {
+        optimizeBranches(list, true);
+    }
     return true;
 }
 
+/*
+ * Every effect and output starts with a queue, so a tee can feed several of
+ * them from one streaming thread. Behind a tee with a single branch that is
+ * just one more thread hop per buffer, the graph upstream already has its
+ * own boundary in the media object's queue. Such queues are taken out of the
+ * path by pointing the bin's ghost pad past them, and put back once a second
+ * branch comes along.
+ *
+ * Tees themselves stay, with one branch they push straight through and they
+ * are what lets branches come and go while playing. Adjacent converters
+ * are left alone as well, they run in passthrough whenever the caps match.
+ */
+void MediaNode::optimizeBranches(QList<QObject *> &list, bool bypass)
+{
+    // A prerolled sink may block its pad forever, see disconnectNode(), so
+    // no queue can be drained while paused. Putting one back only relinks
+    // pads, which is fine in any state.
+    if (bypass && root()->pipeline()->state() == GST_STATE_PAUSED) {
+        return;
+    }
+    foreach (QObject *sink, list) {
+        if (MediaNode *node = qobject_cast<MediaNode*>(sink)) {
+            node->setHeadQueueBypassed(bypass);
+        }
+    }
+}
+
+enum BypassState {
+    BypassPending,
+    BypassApplied,
+    BypassCancelled
+};
+
+void MediaNode::setHeadQueueBypassed(bool bypass)
+{
+    if (bypass == (m_bypassedQueue != 0)) {
+        return;
+    }
+    GstElement *element = (description() & AudioSink) ? audioElement() : videoElement();
+    if (!element || !GST_IS_BIN(element)) {
+        return;
+    }
+    GstPad *ghost = gst_element_get_static_pad(element, "sink");
+    if (!ghost || !GST_IS_GHOST_PAD(ghost)) {
+        if (ghost) {
+            gst_object_unref(ghost);
+        }
+        return;
+    }
+    GstPad *target = gst_ghost_pad_get_target(GST_GHOST_PAD(ghost));
+    GstPad *feed = gst_pad_get_peer(ghost);
+    const bool hot = feed && root()->pipeline()->state() == GST_STATE_PLAYING;
+
+    if (bypass) {
+        GstElement *queue = target ? gst_pad_get_parent_element(target) : 0;
+        GstElementFactory *factory = queue ? gst_element_get_factory(queue) : 0;
+        GstPad *queueSrc = queue ? gst_element_get_static_pad(queue, "src") : 0;
+        GstPad *next = queueSrc ? gst_pad_get_peer(queueSrc) : 0;
+        if (factory && next && !qstrcmp(GST_OBJECT_NAME(factory), "queue")) {
+            debug() << "Bypassing the head queue of" << name();
+            QSharedPointer<QAtomicInt> pending(new QAtomicInt(BypassPending));
+            gst_object_ref(ghost);
+            gst_object_ref(queueSrc);
+            gst_object_ref(next);
+            std::function<void()> task = [ghost, queueSrc, next, pending]() {
+                // A restore that came first keeps the queue in the path.
+                if (pending->testAndSetOrdered(BypassPending, BypassApplied)) {
+                    gst_pad_unlink(queueSrc, next);
+                    gst_ghost_pad_set_target(GST_GHOST_PAD(ghost), next);
+                }
+                gst_object_unref(next);
+                gst_object_unref(queueSrc);
+                gst_object_unref(ghost);
+            };
+            gst_object_ref(element);
+            gst_object_ref(queue);
+            gst_object_ref(ghost);
+            gst_object_ref(target);
+            std::function<void()> done = [element, queue, ghost, target, pending]() {
+                // Unless the queue got put back while draining, its restore
+                // may still be waiting to relink it.
+                GstPad *current = gst_ghost_pad_get_target(GST_GHOST_PAD(ghost));
+                if (current != target && pending->loadAcquire() != BypassCancelled) {
+                    gst_element_set_state(queue, GST_STATE_NULL);
+                    gst_bin_remove(GST_BIN(element), queue);
+                }
+                if (current) {
+                    gst_object_unref(current);
+                }
+                gst_object_unref(target);
+                gst_object_unref(ghost);
+                gst_object_unref(queue);
+                gst_object_unref(element);
+            };
+            m_bypassedQueue = GST_ELEMENT(gst_object_ref(queue));
+            if (hot) {
+                // Retargeting right away would drop whatever the queue holds.
+                m_pendingBypass = pending;
+                runWhenDrained(root()->pipeline(), feed, target, queueSrc, task, done);
+            } else {
+                task();
+                done();
+            }
+        }
+        if (next) {
+            gst_object_unref(next);
+        }
+        if (queueSrc) {
+            gst_object_unref(queueSrc);
+        }
+        if (queue) {
+            gst_object_unref(queue);
+        }
+    } else if (target) {
+        debug() << "Restoring the head queue of" << name();
+        GstElement *queue = m_bypassedQueue;
+        m_bypassedQueue = 0;
+        if (m_pendingBypass) {
+            m_pendingBypass->fetchAndStoreOrdered(BypassCancelled);
+            m_pendingBypass.clear();
+        }
+        // Still in the bin while a bypass drains the queue.
+        if (GST_ELEMENT_PARENT(queue) != element) {
+            gst_bin_add(GST_BIN(element), queue);
+            gst_element_sync_state_with_parent(queue);
+        }
+        gst_object_unref(queue);
+        GstPad *queueSink = gst_element_get_static_pad(queue, "sink");
+        GstPad *queueSrc = gst_element_get_static_pad(queue, "src");
+        gst_object_ref(ghost);
+        std::function<void()> task = [ghost, queueSink, queueSrc]() {
+            // Looked up only now, a bypass may still have been draining.
+            GstPad *next = gst_ghost_pad_get_target(GST_GHOST_PAD(ghost));
+            if (next && next != queueSink) {
+                gst_ghost_pad_set_target(GST_GHOST_PAD(ghost), queueSink);
+                gst_pad_link(queueSrc, next);
+            }
+            if (next) {
+                gst_object_unref(next);
+            }
+            gst_object_unref(queueSink);
+            gst_object_unref(queueSrc);
+            gst_object_unref(ghost);
+        };
+        if (hot) {
+            root()->pipeline()->runWhenIdle(feed, task);
+        } else {
+            task();
+        }
+    }
+
+    if (feed) {
+        gst_object_unref(feed);
+    }
+    if (target) {
+        gst_object_unref(target);
+    }
+    gst_object_unref(ghost);
+}
+
 bool MediaNode::link()
 {
     // Rewire everything
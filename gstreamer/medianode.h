@@ -20,7 +20,10 @@
 
 
 #include <QtCore/QObject>
+#include <QtCore/QAtomicInt>
 #include <QtCore/QList>
+#include <QtCore/QPointer>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QSize>
 
 #include <gst/gstelement.h>
@@ -103,10 +106,22 @@ protected:
 
 private:
     bool addOutput(MediaNode *, GstElement *tee);
+    void updateConnectedOutputs();
+    void optimizeBranches(QList<QObject *> &list, bool bypass);
+    void setHeadQueueBypassed(bool bypass);
+    void breakPendingGraph();
     NodeDescription m_description;
 
     // Sometimes Phonon::Path::reconnect gets called for no good reason.
     bool m_finalized;
+    // Queue taken out of the head of this node's bin, see optimizeBranches().
+    GstElement *m_bypassedQueue;
+    // Set while that queue is still draining, a restore cancels the bypass
+    // through it.
+    QSharedPointer<QAtomicInt> m_pendingBypass;
+    // Media object this node got disconnected from while its branch was
+    // still busy, see disconnectNode().
+    QPointer<QObject> m_pendingBreakRoot;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(MediaNode::NodeDescription)
@@ -34,6 +34,7 @@
 #include <QtCore/QEvent>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QMutexLocker>
 #include <QtCore/QPointer>
 #include <QtCore/QStringList>
 #include <QtCore/QTimer>
@@ -44,7 +45,6 @@
 
 #define ABOUT_TO_FINNISH_TIME 2000
 #define MAX_QUEUE_TIME 20 * GST_SECOND
-#define GST_PLAY_FLAG_TEXT (1 << 2)
 
 namespace Phonon
 {
@@ -60,6 +60,7 @@ MediaObject::MediaObject(Backend *backend, QObject *parent)
         , m_state(Phonon::StoppedState)
         , m_pendingState(Phonon::LoadingState)
         , m_tickTimer(new QTimer(this))
+        , m_tickInterval(0)
         , m_prefinishMark(0)
         , m_transitionTime(0)
         , m_isStream(false)
@@ -78,8 +79,9 @@ MediaObject::MediaObject(Backend *backend, QObject *parent)
         , m_waitingForPreviousSource(false)
         , m_skippingEOS(false)
         , m_doingEOS(false)
-        , m_skipGapless(false)
-        , m_handlingAboutToFinish(false)
+        , m_gaplessMissed(false)
+        , m_graphTransactions(0)
+        , m_graphDirty(false)
 {
     qRegisterMetaType<GstCaps*>("GstCaps*");
     qRegisterMetaType<State>("State");
@@ -128,6 +130,9 @@ MediaObject::MediaObject(Backend *backend, QObject *parent)
     connect(m_pipeline, SIGNAL(trackCountChanged(int)),
             this, SLOT(handleTrackCountChange(int)));
 
+    connect(m_pipeline, SIGNAL(clockTick()), SLOT(emitTick()));
+    connect(m_pipeline, SIGNAL(positionAlarm(int)), SLOT(handlePositionAlarm(int)));
+    // Only used if the pipeline has no clock to drive the ticks.
     connect(m_tickTimer, SIGNAL(timeout()), SLOT(emitTick()));
 }
 
@@ -154,10 +159,39 @@ void MediaObject::saveState()
     }
 }
 
+void MediaObject::beginGraphTransaction()
+{
+    ++m_graphTransactions;
+}
+
+void MediaObject::commitGraphTransaction()
+{
+    Q_ASSERT(m_graphTransactions > 0);
+    if (--m_graphTransactions > 0 || !m_graphDirty) {
+        return;
+    }
+    m_graphDirty = false;
+    buildGraph();
+}
+
+void MediaObject::requestGraphBuild()
+{
+    if (m_graphTransactions > 0) {
+        m_graphDirty = true;
+        return;
+    }
+    buildGraph();
+}
+
 void MediaObject::resumeState()
 {
     if (m_resumeState) {
         m_resumeState = false;
+        // Nodes linked or unlinked while playing leave the pipeline alone.
+        if (translateState(m_pipeline->state()) == m_oldState &&
+            m_pipeline->pendingState() == GST_STATE_VOID_PENDING) {
+            return;
+        }
         requestState(m_oldState);
         seek(m_oldPos);
     }
@@ -229,9 +263,27 @@ void MediaObject::setTickInterval(qint32 newTickInterval)
 {
     m_tickInterval = newTickInterval;
     if (m_tickInterval <= 0) {
-        m_tickTimer->setInterval(50);
+        // Nothing needs ticks to be watched anymore, the prefinish mark has
+        // its own alarm.
+        m_pipeline->stopTicks();
+        m_tickTimer->stop();
+        return;
+    }
+    m_tickTimer->setInterval(newTickInterval);
+    if (m_state == Phonon::PlayingState) {
+        startTicks();
+    }
+}
+
+void MediaObject::startTicks()
+{
+    if (m_tickInterval <= 0) {
+        return;
+    }
+    if (m_pipeline->startTicks(m_tickTimer->interval())) {
+        m_tickTimer->stop();
     } else {
-        m_tickTimer->setInterval(newTickInterval);
+        m_tickTimer->start();
     }
 }
 
@@ -355,29 +407,22 @@ void MediaObject::setNextSource(const MediaSource &source)
 {
     DEBUG_BLOCK;
 
-    m_aboutToFinishLock.lock();
-    if (m_handlingAboutToFinish) {
-        debug() << "Got next source. Waiting for end of current.";
-
-        // If next source is valid and is not empty (an empty source is sent by Phonon if
-        // there are no more sources) skip EOS for the current source in order to seamlessly
-        // pass to the next source.
-        if (source.type() == Phonon::MediaSource::Invalid ||
-            source.type() == Phonon::MediaSource::Empty) {
-            m_skippingEOS = false;
-        } else {
-            m_skippingEOS = true;
-        }
+    // An empty source is sent by Phonon if there are no more sources.
+    if (source.type() == Phonon::MediaSource::Invalid ||
+        source.type() == Phonon::MediaSource::Empty) {
+        return;
+    }
 
-        m_waitingForNextSource = true;
-        m_waitingForPreviousSource = false;
-        m_skipGapless = false;
-        m_pipeline->setSource(source);
-        m_aboutToFinishWait.wakeAll();
+    QMutexLocker locker(&m_gaplessLock);
+    if (m_gaplessMissed) {
+        // The pipeline already asked and went on without it, so the source
+        // gets started once the current one ended.
+        debug() << "Got next source too late for gapless playback.";
+        m_nextSource = source;
     } else {
-        qDebug() << "Ignoring source as no aboutToFinish handling is in progress.";
+        debug() << "Queueing next source for gapless playback.";
+        m_gaplessQueue.enqueue(source);
     }
-    m_aboutToFinishLock.unlock();
 }
 
 qint64 MediaObject::getPipelinePos() const
@@ -405,9 +450,13 @@ void MediaObject::setSource(const MediaSource &source)
     debug() << "Setting new source";
     m_source = source;
     autoDetectSubtitle();
+    QMutexLocker locker(&m_gaplessLock);
     m_pipeline->setSource(source);
-    m_skipGapless = false;
-    m_aboutToFinishWait.wakeAll();
+    m_gaplessQueue.clear();
+    m_gaplessSwitches.clear();
+    m_nextSource = MediaSource();
+    m_gaplessMissed = false;
+    m_aboutToFinishEmitted = false;
     //emit currentSourceChanged(source);
 }
 
@@ -489,6 +538,61 @@ void MediaObject::setPrefinishMark(qint32 newPrefinishMark)
     if (currentTime() < totalTime() - m_prefinishMark) { // not about to finish
         m_prefinishMarkReachedNotEmitted = true;
     }
+    scheduleAlarms();
+}
+
+/*
+ * Sets clock alarms for the exact moment the prefinish mark is reached and for
+ * asking the frontend for the next source. Has to be redone whenever the
+ * position jumps or the duration changes.
+ */
+void MediaObject::scheduleAlarms(qint64 from)
+{
+    m_pipeline->clearPositionAlarm(PrefinishAlarm);
+    m_pipeline->clearPositionAlarm(AboutToFinishAlarm);
+    if (m_state != Phonon::PlayingState || totalTime() <= 0 || m_pipeline->isLooping()) {
+        return;
+    }
+    if (m_prefinishMark > 0 && m_prefinishMarkReachedNotEmitted) {
+        m_pipeline->setPositionAlarm(PrefinishAlarm, totalTime() - m_prefinishMark, from);
+    }
+    QMutexLocker locker(&m_gaplessLock);
+    if (!m_aboutToFinishEmitted) {
+        // Ask for the next source well before playbin can need it, which is
+        // once the queues in front of the sinks hold the rest of the stream.
+        // Sources shorter than that lead would be asked for right at the
+        // start, so they are asked halfway through instead. Should playbin
+        // need the next source before, handleAboutToFinish() asks anyway.
+        const qint64 lead = MAX_QUEUE_TIME / GST_MSECOND + ABOUT_TO_FINNISH_TIME;
+        m_pipeline->setPositionAlarm(AboutToFinishAlarm, qMax(totalTime() - lead, totalTime() / 2), from);
+    }
+}
+
+void MediaObject::handlePositionAlarm(int alarm)
+{
+    if (alarm == AboutToFinishAlarm) {
+        QMutexLocker locker(&m_gaplessLock);
+        if (m_aboutToFinishEmitted) {
+            return;
+        }
+        m_aboutToFinishEmitted = true;
+        // The frontend answers with setNextSource(), possibly right away.
+        locker.unlock();
+        emit aboutToFinish();
+        return;
+    }
+
+    if (alarm != PrefinishAlarm || !m_prefinishMarkReachedNotEmitted) {
+        return;
+    }
+    const qint64 currentTime = getPipelinePos();
+    // The alarm was computed from an estimate, e.g. right after a seek.
+    if (currentTime < totalTime() - m_prefinishMark) {
+        scheduleAlarms(currentTime);
+        return;
+    }
+    m_prefinishMarkReachedNotEmitted = false;
+    emit prefinishMarkReached(totalTime() - currentTime);
 }
 
 void MediaObject::pause()
@@ -511,10 +615,17 @@ void MediaObject::seek(qint64 time)
         debug() << "Seeking back within old source";
         m_waitingForNextSource = false;
         m_waitingForPreviousSource = true;
+        QMutexLocker locker(&m_gaplessLock);
+        // The next source goes back into the queue for the next about-to-finish.
+        m_gaplessQueue.prepend(m_pipeline->currentSource());
         m_pipeline->setSource(m_source, true);
     }
     m_pipeline->seekToMSec(time);
     m_lastTime = 0;
+    if (time < totalTime() - m_prefinishMark) {
+        m_prefinishMarkReachedNotEmitted = true;
+    }
+    scheduleAlarms(time);
 }
 
 void MediaObject::handleStreamChange()
@@ -527,6 +638,13 @@ void MediaObject::handleStreamChange()
         m_source = m_pipeline->currentSource();
         m_sourceMeta = m_pipeline->metaData();
         m_waitingForNextSource = false;
+        // The switch went through, an EOS from here on ends this source.
+        m_skippingEOS = false;
+        m_prefinishMarkReachedNotEmitted = true;
+        m_gaplessLock.lock();
+        m_aboutToFinishEmitted = false;
+        m_gaplessMissed = false;
+        m_gaplessLock.unlock();
         emit metaDataChanged(m_pipeline->metaData());
         emit currentSourceChanged(m_pipeline->currentSource());
     }
@@ -538,6 +656,7 @@ void MediaObject::handleDurationChange(qint64 duration)
     debug() << duration;
     m_totalTime = duration;
     emit totalTimeChanged(duration);
+    scheduleAlarms();
 }
 
 void MediaObject::emitTick()
@@ -546,21 +665,12 @@ void MediaObject::emitTick()
         return;
     }
 
-    qint64 currentTime = getPipelinePos();
+    qint64 currentTime = m_pipeline->estimatedPosition();
     // We don't get any other kind of notification when we change DVD chapters, so here's the best place...
     // TODO: Verify that this is fixed with playbin2 and that we don't need to manually update the
     // time when playing a DVD.
     //updateTotalTime();
     emit tick(currentTime);
-
-    if (m_state == Phonon::PlayingState) {
-        if (currentTime >= totalTime() - m_prefinishMark) {
-            if (m_prefinishMarkReachedNotEmitted) {
-                m_prefinishMarkReachedNotEmitted = false;
-                emit prefinishMarkReached(totalTime() - currentTime);
-            }
-        }
-    }
 }
 
 /**
@@ -605,9 +715,13 @@ void MediaObject::handleStateChange(GstState oldState, GstState newState)
         _iface_setCurrentTitle(m_pendingTitle);
     }
     if (newState == GST_STATE_PLAYING) {
-        m_tickTimer->start();
+        startTicks();
+        scheduleAlarms();
     } else {
+        m_pipeline->stopTicks();
         m_tickTimer->stop();
+        m_pipeline->clearPositionAlarm(PrefinishAlarm);
+        m_pipeline->clearPositionAlarm(AboutToFinishAlarm);
     }
 
     if (newState == GST_STATE_READY) {
@@ -616,6 +730,8 @@ void MediaObject::handleStateChange(GstState oldState, GstState newState)
 
     if (!m_doingEOS) {
         emit stateChanged(m_state, prevPhononState);
+    } else if (newState <= GST_STATE_READY) {
+        m_doingEOS = false;
     }
 }
 
@@ -634,20 +750,33 @@ void MediaObject::handleEndOfStream()
 {
     DEBUG_BLOCK;
     if (!m_skippingEOS) {
+        m_gaplessLock.lock();
+        const MediaSource next = m_nextSource;
+        m_nextSource = MediaSource();
+        m_gaplessLock.unlock();
+        if (next.type() != MediaSource::Invalid) {
+            // Not gapless, but the frontend still gets its next source played.
+            debug() << "starting late next source";
+            m_pipeline->requestState(GST_STATE_READY);
+            setSource(next);
+            m_pipeline->requestState(GST_STATE_PLAYING);
+            return;
+        }
+
         debug() << "not skipping EOS";
         m_doingEOS = true;
         { // When working on EOS we do not want signals emitted to avoid bogus UI updates.
             emit stateChanged(Phonon::StoppedState, m_state);
-            m_aboutToFinishWait.wakeAll();
-            m_pipeline->setState(GST_STATE_READY);
+            m_pipeline->requestState(GST_STATE_READY);
             emit finished();
         }
-        m_doingEOS = false;
+        // Cleared by handleStateChange() once the pipeline reached READY.
     } else {
         debug() << "skipping EOS";
-        GstState state = m_pipeline->state();
-        m_pipeline->setState(GST_STATE_READY);
-        m_pipeline->setState(state);
+        GstState state = m_pipeline->pendingState() != GST_STATE_VOID_PENDING ?
+                         m_pipeline->pendingState() : m_pipeline->state();
+        m_pipeline->requestState(GST_STATE_READY);
+        m_pipeline->requestState(state);
         m_skippingEOS = false;
     }
 }
@@ -657,11 +786,75 @@ void MediaObject::handleEndOfStream()
 bool MediaObject::hasInterface(Interface iface) const
 {
     return iface == AddonInterface::TitleInterface || iface == AddonInterface::NavigationInterface
-        || iface == AddonInterface::SubtitleInterface || iface == AddonInterface::AudioChannelInterface;
+        || iface == AddonInterface::SubtitleInterface || iface == AddonInterface::AudioChannelInterface
+        || int(iface) == SeekModeInterface || int(iface) == PlaybackRateInterface
+        || int(iface) == LoopInterface;
 }
 
 QVariant MediaObject::interfaceCall(Interface iface, int command, const QList<QVariant> &params)
 {
+    // Not a value of Interface, so kept out of the switch below.
+    if (int(iface) == SeekModeInterface) {
+        switch (command)
+        {
+            case seekMode:
+                return int(m_pipeline->seekMode());
+            case setSeekMode: {
+                const int mode = params.isEmpty() ? -1 : params.first().toInt();
+                if (mode < Pipeline::DefaultSeek || mode > Pipeline::TrickModeSeek) {
+                    error() << Q_FUNC_INFO << "arguments invalid";
+                    return QVariant();
+                }
+                m_pipeline->setSeekMode(Pipeline::SeekMode(mode));
+                break;
+            }
+        }
+        return QVariant();
+    }
+
+    if (int(iface) == PlaybackRateInterface) {
+        switch (command)
+        {
+            case playbackRate:
+                return m_pipeline->playbackRate();
+            case setPlaybackRate: {
+                if (params.isEmpty() || !params.first().canConvert<double>()) {
+                    error() << Q_FUNC_INFO << "arguments invalid";
+                    return QVariant();
+                }
+                const bool ok = m_pipeline->setPlaybackRate(params.first().toDouble());
+                // The end of the source comes up at a different pace now.
+                scheduleAlarms();
+                return ok;
+            }
+        }
+        return QVariant();
+    }
+
+    if (int(iface) == LoopInterface) {
+        switch (command)
+        {
+            case isLooping:
+                return m_pipeline->isLooping();
+            case setLoop: {
+                if (params.isEmpty()) {
+                    error() << Q_FUNC_INFO << "arguments invalid";
+                    return QVariant();
+                }
+                const qint64 end = params.size() > 1 ? params.at(1).toLongLong() : -1;
+                const bool ok = m_pipeline->setLoop(params.first().toLongLong(), end);
+                // The end of the source is not coming up anymore.
+                scheduleAlarms();
+                return ok;
+            }
+            case clearLoop:
+                m_pipeline->clearLoop();
+                scheduleAlarms();
+                break;
+        }
+        return QVariant();
+    }
+
     if (hasInterface(iface)) {
 
         switch (iface)
@@ -857,23 +1050,19 @@ void MediaObject::_iface_setCurrentSubtitle(const SubtitleDescription &subtitle)
         // consists to restart the pipeline and set the suburi property (totem does exactly the same thing)
         // TODO: Harald suggests to insert a empty bin into the playbin2 pipeline and then insert a subtitle element
         // on the fly into that bin when the subtitle feature is required...
-        stop();
-        changeSubUri(Mrl(filename));
-        play();
+        // The suburi can only be changed once the pipeline really is in READY.
+        m_pipeline->requestState(GST_STATE_READY, [this, filename]() {
+            changeSubUri(Mrl(filename));
+            play();
+        });
         m_currentSubtitle = subtitle;
         GlobalSubtitles::instance()->add(this, m_currentSubtitle);
         emit availableSubtitlesChanged();
     } else {
         const int localIndex = GlobalSubtitles::instance()->localIdFor(this, subtitle.index());
-        int flags;
 
-        g_object_get(G_OBJECT(m_pipeline->element()), "flags", &flags, NULL);
-        if (localIndex == -1) {
-            flags &= ~GST_PLAY_FLAG_TEXT;
-        } else {
-            flags |= GST_PLAY_FLAG_TEXT;
-        }
-        g_object_set(G_OBJECT(m_pipeline->element()), "flags", flags, "current-text", localIndex, NULL);
+        m_pipeline->setSubtitlesEnabled(localIndex != -1);
+        g_object_set(G_OBJECT(m_pipeline->element()), "current-text", localIndex, NULL);
         m_currentSubtitle = subtitle;
     }
 }
@@ -917,31 +1106,20 @@ void MediaObject::setMetaData(QMultiMap<QString, QString> newData)
 void MediaObject::requestState(Phonon::State state)
 {
     DEBUG_BLOCK;
-    // Only abort handling here iff the handler is active.
-    if (m_aboutToFinishLock.tryLock()) {
-        // Note that this is not condition to unlocking, so the nesting is
-        // necessary.
-        if (m_handlingAboutToFinish) {
-            qDebug() << "Aborting aboutToFinish handling.";
-            m_skipGapless = true;
-            m_aboutToFinishWait.wakeAll();
-        }
-        m_aboutToFinishLock.unlock();
-    }
     debug() << state;
     switch (state) {
         case Phonon::PlayingState:
-            m_pipeline->setState(GST_STATE_PLAYING);
+            m_pipeline->requestState(GST_STATE_PLAYING);
             break;
         case Phonon::PausedState:
-            m_pipeline->setState(GST_STATE_PAUSED);
+            m_pipeline->requestState(GST_STATE_PAUSED);
             break;
         case Phonon::StoppedState:
-            m_pipeline->setState(GST_STATE_READY);
+            m_pipeline->requestState(GST_STATE_READY);
             break;
         case Phonon::ErrorState:
             // Use ErrorState to represent a fatal error
-            m_pipeline->setState(GST_STATE_NULL);
+            m_pipeline->requestState(GST_STATE_NULL);
             break;
         case Phonon::LoadingState: //Quiet GCC
         case Phonon::BufferingState:
@@ -953,55 +1131,51 @@ void MediaObject::handleAboutToFinish()
 {
     DEBUG_BLOCK;
     debug() << "About to finish";
-    m_aboutToFinishLock.lock();
-    m_handlingAboutToFinish = true;
-    if (!m_waitingForNextSource) {
+    // Runs in a streaming thread, which must not wait for the frontend, so
+    // only what got queued up front or from within aboutToFinish() can be
+    // played gaplessly. Nothing but the playbin uri is touched here,
+    // handleGaplessSwitch() does the rest.
+    QMutexLocker locker(&m_gaplessLock);
+    if (m_gaplessQueue.isEmpty() && !m_aboutToFinishEmitted) {
+        // The alarm did not get to ask yet, e.g. after seeking close to the
+        // end. Frontends answer right away through setNextSource(), which
+        // still queues the source as the switch is not missed yet.
+        m_aboutToFinishEmitted = true;
+        locker.unlock();
         emit aboutToFinish();
+        locker.relock();
+    }
+    if (!m_gaplessQueue.isEmpty() && m_pipeline->setGaplessUri(m_gaplessQueue.head())) {
+        debug() << "Continuing gapless with the queued source";
+        m_gaplessSwitches.enqueue(m_gaplessQueue.dequeue());
+        locker.unlock();
+        QMetaObject::invokeMethod(this, "handleGaplessSwitch", Qt::QueuedConnection);
+        return;
     }
 
-    // As our signal gets emitted queued we need to wait here until either a
-    // new source or a timeout is reached.
-    // If we got a new source in time -> hooray + gapless
-    // If we did not get a new source in time -> boooh + stop()
-    if (!m_skipGapless) {
-        // Dynamic lock timeout is our friend.
-        // Instead of simply waiting for a fixed amount of ms for the next source, we wait for the
-        // most sensible amount of time. This is whatever amount of time is remaining to play
-        // minus a 0.5 seconds safety delta (time values not precise etc.).
-        // A source for which we have no time or for which the remaining time is < 0.5 seconds is
-        // immediately unlocked again. Otherwise the consumer has as much time as gst gave us to
-        // set a new source.
-        // This in particular prevents pointless excessive locking on sources which have a totalTime
-        // < whatever fixed lock value we have (so that we'd lock longer than what we are playing).
-        // An issue apparent with notification-like sounds, that are rather short and do not need
-        // gapless transitioning. As outlined in https://bugs.kde.org/show_bug.cgi?id=307530
-        unsigned long timeout = 0;
-        debug() << "total time" << totalTime();
-        debug() << "current time" << currentTime();
-        debug() << "remaining time" << remainingTime();
-        if (totalTime() <= 0 || (remainingTime() - 500 <= 0)) {
-            timeout = 0;
-        } else {
-            timeout = remainingTime() - 500;
-        }
+    debug() << "No next source queued, skipping gapless audio";
+    m_gaplessMissed = true;
+    if (!m_gaplessQueue.isEmpty()) {
+        // Not something playbin can open by itself, it gets started once the
+        // current source ended.
+        m_nextSource = m_gaplessQueue.dequeue();
+    }
+}
 
-        debug() << "waiting for" << timeout;
-        if (m_aboutToFinishWait.wait(&m_aboutToFinishLock, timeout)) {
-            debug() << "Finally got a source";
-            if (m_skipGapless) { // Was explicitly set by stateChange interrupt
-                debug() << "...oh, no, just got aborted, skipping EOS";
-                m_skippingEOS = false;
-            }
-        } else {
-            warning() << "aboutToFinishWait timed out!";
-            m_skippingEOS = false;
-        }
-    } else {
-        debug() << "Skipping gapless audio";
-        m_skippingEOS = false;
+void MediaObject::handleGaplessSwitch()
+{
+    DEBUG_BLOCK;
+    QMutexLocker locker(&m_gaplessLock);
+    if (m_gaplessSwitches.isEmpty()) {
+        // setSource() came in between and dropped it.
+        return;
     }
-    m_handlingAboutToFinish = false;
-    m_aboutToFinishLock.unlock();
+    const MediaSource next = m_gaplessSwitches.dequeue();
+    locker.unlock();
+    m_pipeline->adoptGaplessSource(next);
+    m_skippingEOS = true;
+    m_waitingForNextSource = true;
+    m_waitingForPreviousSource = false;
 }
 
 } // ns Gstreamer
@@ -27,10 +27,10 @@
 #include <phonon/MediaController>
 
 #include <QtCore/QObject>
+#include <QtCore/QQueue>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QVariant>
-#include <QtCore/QWaitCondition>
 #include <QtCore/QMutex>
 
 #include "phonon-config-gstreamer.h" // krazy:exclude=includes
@@ -87,6 +87,30 @@ public:
 
     Phonon::State translateState(GstState state) const;
 
+    // Backend specific addon interface, there is no MediaController
+    // counterpart so applications call interfaceCall() directly.
+    enum {
+        SeekModeInterface = 0x5ee0,
+        PlaybackRateInterface,
+        LoopInterface
+    };
+    enum SeekModeCommand {
+        seekMode,
+        // Takes a Pipeline::SeekMode as int.
+        setSeekMode
+    };
+    enum PlaybackRateCommand {
+        playbackRate,
+        // Takes the rate as double, see Pipeline::setPlaybackRate().
+        setPlaybackRate
+    };
+    enum LoopCommand {
+        isLooping,
+        // Takes start and optionally end in ms, see Pipeline::setLoop().
+        setLoop,
+        clearLoop
+    };
+
     QString errorString() const override;
     Phonon::ErrorType errorType() const override;
 
@@ -141,6 +165,15 @@ public:
     void saveState();
     void resumeState();
 
+    /*
+     * Connections made in between only mark the graph as changed, it is
+     * built once on commit. Building only links what is missing.
+     */
+    void beginGraphTransaction();
+    void commitGraphTransaction();
+    // Builds the graph now, or on commit if a transaction is open.
+    void requestGraphBuild();
+
     QMultiMap<QString, QString> metaData();
     void setMetaData(QMultiMap<QString, QString> newData);
 
@@ -204,12 +237,22 @@ private Q_SLOTS:
     void handleDurationChange(qint64);
 
     void handleAboutToFinish();
+    void handleGaplessSwitch();
     void handleStreamChange();
+    void handlePositionAlarm(int alarm);
 
 private:
     // GStreamer specific :
     void setTotalTime(qint64 newTime);
     qint64 getPipelinePos() const;
+    void startTicks();
+    void scheduleAlarms(qint64 from = -1);
+
+    // Position alarms set on the pipeline.
+    enum Alarm {
+        PrefinishAlarm,
+        AboutToFinishAlarm
+    };
 
     int _iface_availableTitles() const;
     int _iface_currentTitle() const;
@@ -260,7 +303,7 @@ private:
     int m_pendingTitle;
 
     // When we emit aboutToFinish(), libphonon calls setNextSource. To achieve gapless playback,
-    // the pipeline is immediately told to start using that new source. This can break seeking
+    // the pipeline is told to start using that new source as soon as playbin asks. This can break seeking
     // since the aboutToFinish signal tends to be emitted around 15 seconds or so prior to actually
     // ending the current track.
     // If we seek backwards in time, we'd still have the 'next' source but now be a different
@@ -281,15 +324,23 @@ private:
     Phonon::MediaSource m_source;
     QMultiMap<QString, QString> m_sourceMeta;
 
-    //This simply pauses the gst signal handler 'till we get something
-    QMutex m_aboutToFinishLock;
-    QWaitCondition m_aboutToFinishWait;
-
     qint64 m_lastTime;
-    bool m_skipGapless;
 
-    /*** Tracks wherever the MO is actively handling an aboutToFinish CB right now. */
-    bool m_handlingAboutToFinish;
+    // Sources handed over by setNextSource() ahead of time, handleAboutToFinish()
+    // takes the next one from here without ever waiting for the frontend.
+    // Also guards m_nextSource and m_aboutToFinishEmitted.
+    // They are not prerolled in a second pipeline: playbin cannot adopt the
+    // demuxer and decoders of another one, and the outputs can only live in
+    // one bin, so swapping at the boundary rebuilds more than it saves.
+    QMutex m_gaplessLock;
+    QQueue<MediaSource> m_gaplessQueue;
+    // Handed to playbin by handleAboutToFinish(), waiting for
+    // handleGaplessSwitch() to catch up on the GUI thread.
+    QQueue<MediaSource> m_gaplessSwitches;
+    // The pipeline asked for the next source while the queue was empty.
+    bool m_gaplessMissed;
+    int m_graphTransactions;
+    bool m_graphDirty;
 };
 }
 } //namespace Phonon::Gstreamer
@@ -24,6 +24,7 @@
 #include "debug.h"
 #include "plugininstaller.h"
 #include "streamreader.h"
+#include "threadpolicy.h"
 #include "gsthelper.h"
 #include "phonon-config-gstreamer.h"
 #include <gst/pbutils/missing-plugins.h>
@@ -31,14 +32,55 @@
 #include <gst/video/navigation.h>
 #include <gst/app/gstappsrc.h>
 #include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
 
 #define MAX_QUEUE_TIME 20 * GST_SECOND
+// From GstPlayFlags in playbin
+#define GST_PLAY_FLAG_VIDEO (1 << 0)
+#define GST_PLAY_FLAG_AUDIO (1 << 1)
+#define GST_PLAY_FLAG_TEXT (1 << 2)
+// Playback rates beyond this are played in trick mode
+#define MAX_TRICKLESS_RATE 2.0
+// How long estimatedPosition() extrapolates before querying the pipeline again
+#define POSITION_REQUERY_INTERVAL 1000 * GST_MSECOND
 namespace Phonon
 {
 namespace Gstreamer
 {
 
+/*
+ * User data of the async clock waits. The callbacks run in the clock thread
+ * and only reach the pipeline under the lock, which the pipeline takes to let
+ * go of it, so it is either still there or the callback does nothing. Every
+ * wait holds a reference, dropped by the destroy notify.
+ */
+struct ClockContext
+{
+    QAtomicInt refs;
+    QMutex lock;
+    Pipeline *pipeline;
+};
+
+static ClockContext *refClockContext(ClockContext *context)
+{
+    context->refs.ref();
+    return context;
+}
+
+static void unrefClockContext(gpointer data)
+{
+    ClockContext *context = static_cast<ClockContext*>(data);
+    if (!context->refs.deref()) {
+        delete context;
+    }
+}
+
 Pipeline::Pipeline(QObject *parent)
     : QObject(parent)
     , m_bufferPercent(0)
@@ -49,7 +91,36 @@ Pipeline::Pipeline(QObject *parent)
     , m_seeking(false)
     , m_resetting(false)
     , m_posAtReset(0)
+    , m_stateAfterReset(GST_STATE_VOID_PENDING)
+    , m_currentState(GST_STATE_NULL)
+    , m_pendingState(GST_STATE_VOID_PENDING)
+    , m_live(false)
+    , m_stateWorker(new QThreadPool(this))
+    , m_continuationState(GST_STATE_VOID_PENDING)
+    , m_seekInFlight(false)
+    , m_pendingSeek(-1)
+    , m_seekMode(DefaultSeek)
+    , m_playbackRate(1.0)
+    , m_looping(false)
+    , m_loopStart(0)
+    , m_loopEnd(-1)
+    , m_segmentPending(false)
+    , m_audioTempoInserted(false)
+    , m_hasAudioOutput(false)
+    , m_hasVideoOutput(false)
+    , m_subtitlesEnabled(true)
+    , m_clockContext(new ClockContext)
+    , m_tickId(0)
+    , m_anchorValid(false)
+    , m_anchorPos(0)
+    , m_anchorDuration(-1)
+    , m_anchorTime(GST_CLOCK_TIME_NONE)
+    , m_anchorRate(1.0)
+    , m_alarmSerial(0)
 {
+    m_clockContext->refs.storeRelease(1);
+    m_clockContext->pipeline = this;
+    m_stateWorker->setMaxThreadCount(1);
     qRegisterMetaType<GstState>("GstState");
     m_pipeline = GST_PIPELINE(gst_element_factory_make("playbin", NULL));
     gst_object_ref_sink (m_pipeline);
@@ -69,6 +140,9 @@ Pipeline::Pipeline(QObject *parent)
     g_signal_connect(bus, "sync-message::element", G_CALLBACK(cb_element), this);
     g_signal_connect(bus, "sync-message::error", G_CALLBACK(cb_error), this);
     g_signal_connect(bus, "sync-message::stream-start", G_CALLBACK(cb_streamStart), this);
+    g_signal_connect(bus, "sync-message::async-done", G_CALLBACK(cb_asyncDone), this);
+    g_signal_connect(bus, "sync-message::segment-done", G_CALLBACK(cb_segmentDone), this);
+    g_signal_connect(bus, "sync-message::stream-status", G_CALLBACK(cb_streamStatus), this);
     g_signal_connect(bus, "sync-message::tag", G_CALLBACK(cb_tag), this);
     gst_object_unref(bus);
 
@@ -96,6 +170,7 @@ Pipeline::Pipeline(QObject *parent)
     gst_object_unref(audiopad);
 
     g_object_set(m_pipeline, "audio-sink", m_audioGraph, NULL);
+    ThreadPolicy::tag(m_audioGraph, ThreadPolicy::AudioThread);
 
     // Set up video graph
     m_videoGraph = gst_bin_new("videoGraph");
@@ -108,6 +183,7 @@ Pipeline::Pipeline(QObject *parent)
     gst_object_unref(videopad);
 
     g_object_set(m_pipeline, "video-sink", m_videoGraph, NULL);
+    ThreadPolicy::tag(m_videoGraph, ThreadPolicy::VideoThread);
 
     //FIXME: Put this stuff somewhere else, or at least document why its needed.
     if (!tegraEnv.isEmpty()) {
@@ -147,7 +223,7 @@ void Pipeline::setSource(const Phonon::MediaSource &source, bool reset)
     m_isStream = false;
     m_seeking = false;
     m_installer->reset();
-    m_resumeAfterInstall = false;
+    m_resumeAfterInstall.storeRelease(false);
     m_isHttpUrl = false;
     m_metaData.clear();
 
@@ -203,27 +279,86 @@ void Pipeline::setSource(const Phonon::MediaSource &source, bool reset)
     //when using an abstract stream source doesn't explode.
     m_currentSource = source;
 
-    GstState oldState = state();
+    // Restore whatever a transition in progress was heading for.
+    GstState oldState = pendingState() != GST_STATE_VOID_PENDING ? pendingState() : state();
 
     if (reset && oldState > GST_STATE_READY) {
+        // playbin already let go of the decoders of the previous source when
+        // it switched over, so they have to be opened again. The sinks stay
+        // open in READY though, and only prerolling to PAUSED before seeking
+        // avoids decoding and playing the start of the source first.
         debug() << "Resetting pipeline for reverse seek";
-        m_resetting = true;
+        m_resetting.storeRelease(true);
         m_posAtReset = position();
-        gst_element_set_state(GST_ELEMENT(m_pipeline), GST_STATE_READY);
+        m_stateAfterReset = oldState;
     }
 
     debug() << "uri" << gstUri;
     g_object_set(m_pipeline, "uri", gstUri.constData(), NULL);
 
     if (reset && oldState > GST_STATE_READY) {
-        gst_element_set_state(GST_ELEMENT(m_pipeline), oldState);
+        // Tearing down the streaming threads blocks, leave it to the worker.
+        // playbin only picks up the new uri once it went through READY.
+        runAsync([this]() {
+            applyState(GST_STATE_READY, std::function<void()>(), true);
+            applyState(GST_STATE_PAUSED, std::function<void()>(), true);
+        });
     }
 }
 
+bool Pipeline::setGaplessUri(const Phonon::MediaSource &source)
+{
+    // Streams and capture devices need their source set up by setSource().
+    if (source.type() != MediaSource::Url && source.type() != MediaSource::LocalFile) {
+        return false;
+    }
+    const QByteArray gstUri = source.mrl().toEncoded();
+    debug() << "gapless uri" << gstUri;
+    g_object_set(m_pipeline, "uri", gstUri.constData(), NULL);
+    return true;
+}
+
+void Pipeline::adoptGaplessSource(const Phonon::MediaSource &source)
+{
+    m_isStream = false;
+    m_seeking = false;
+    m_installer->reset();
+    m_resumeAfterInstall.storeRelease(false);
+    m_isHttpUrl = source.type() == MediaSource::Url && source.mrl().scheme() == QLatin1String("http");
+    m_currentSource = source;
+    QMutexLocker locker(&m_tagLock);
+    m_metaData.clear();
+}
+
 Pipeline::~Pipeline()
 {
+    {
+        // Waits for a clock callback in progress, later ones find us gone.
+        QMutexLocker locker(&m_clockContext->lock);
+        m_clockContext->pipeline = 0;
+    }
+    stopTicks();
+    foreach (int alarm, m_alarms.keys()) {
+        clearPositionAlarm(alarm);
+    }
+    unrefClockContext(m_clockContext);
+    m_clockContext = 0;
+    // Queued tasks still refer to us.
+    m_stateWorker->waitForDone();
     g_signal_handlers_disconnect_by_data(m_pipeline, this);
     gst_element_set_state(GST_ELEMENT(m_pipeline), GST_STATE_NULL);
+    {
+        // The reader has no parent, nothing pulls from it anymore.
+        QMutexLocker locker(&m_readerLock);
+        if (m_reader) {
+            m_reader->stop();
+            delete m_reader;
+            m_reader = 0;
+        }
+    }
+    // Whatever streaming threads reported back still has its elements to
+    // let go of.
+    runMainThreadTasks();
     gst_object_unref(m_pipeline);
     m_pipeline = 0;
 
@@ -243,18 +378,166 @@ GstElement *Pipeline::element() const
     return GST_ELEMENT(m_pipeline);
 }
 
-GstStateChangeReturn Pipeline::setState(GstState state)
+class PipelineTask : public QRunnable
+{
+public:
+    PipelineTask(const std::function<void()> &task, QAtomicInt *queued)
+        : m_task(task)
+        , m_queued(queued)
+    {
+    }
+
+    ~PipelineTask()
+    {
+        m_queued->deref();
+    }
+
+    void run() override
+    {
+        m_task();
+    }
+
+private:
+    std::function<void()> m_task;
+    QAtomicInt *m_queued;
+};
+
+void Pipeline::runAsync(const std::function<void()> &task)
+{
+    m_queuedTasks.ref();
+    m_stateWorker->start(new PipelineTask(task, &m_queuedTasks));
+}
+
+void Pipeline::requestState(GstState state, const std::function<void()> &then)
+{
+    debug() << "Requesting state" << GstHelper::stateName(state);
+    runAsync([this, state, then]() { applyState(state, then); });
+}
+
+GstStateChangeReturn Pipeline::requestStateAndWait(GstState state, GstClockTime timeout)
+{
+    debug() << "Requesting state" << GstHelper::stateName(state) << "and waiting for it";
+    // Outlives a wait that timed out before the task ran.
+    struct Wait {
+        QSemaphore applied;
+        QAtomicInt ret;
+    };
+    QSharedPointer<Wait> wait(new Wait);
+    wait->ret.storeRelease(GST_STATE_CHANGE_FAILURE);
+    runAsync([this, state, wait]() {
+        wait->ret.storeRelease(applyState(state));
+        wait->applied.release();
+    });
+
+    QElapsedTimer timer;
+    timer.start();
+    const int msecs = GST_CLOCK_TIME_IS_VALID(timeout) ? int(qMin<GstClockTime>(timeout / GST_MSECOND, G_MAXINT)) : -1;
+    if (!wait->applied.tryAcquire(1, msecs)) {
+        return GST_STATE_CHANGE_ASYNC;
+    }
+    const GstStateChangeReturn ret = static_cast<GstStateChangeReturn>(wait->ret.loadAcquire());
+    if (ret != GST_STATE_CHANGE_ASYNC) {
+        return ret;
+    }
+    // Prerolling, whatever of the timeout is left goes to that.
+    GstClockTime left = GST_CLOCK_TIME_NONE;
+    if (GST_CLOCK_TIME_IS_VALID(timeout)) {
+        const GstClockTime elapsed = timer.elapsed() * GST_MSECOND;
+        left = elapsed < timeout ? timeout - elapsed : 0;
+    }
+    return gst_element_get_state(GST_ELEMENT(m_pipeline), NULL, NULL, left);
+}
+
+GstStateChangeReturn Pipeline::applyState(GstState state, const std::function<void()> &then, bool reset)
 {
     DEBUG_BLOCK;
-    m_resumeAfterInstall = true;
+    m_anchorValid.storeRelease(false);
+    m_resumeAfterInstall.storeRelease(true);
     debug() << "Transitioning to state" << GstHelper::stateName(state);
 
-    if (state == GST_STATE_READY && m_reader) {
-        debug() << "forcing stop as we are in ready state and have a reader...";
-        m_reader->stop();
+    if (state <= GST_STATE_READY) {
+        // No ASYNC_DONE is going to finish a seek in flight.
+        QMutexLocker locker(&m_seekLock);
+        m_seekInFlight = false;
+        m_pendingSeek = -1;
+        // Nor does a reset that got superseded before it prerolled.
+        if (!reset) {
+            m_resetting.storeRelease(false);
+        }
+    }
+
+    if (state == GST_STATE_READY) {
+        QMutexLocker locker(&m_readerLock);
+        if (m_reader) {
+            debug() << "forcing stop as we are in ready state and have a reader...";
+            m_reader->stop();
+        }
+    }
+
+    {
+        // Replaces the continuation of whatever transition came before, and
+        // is in place before cb_state can report this one done.
+        QMutexLocker locker(&m_continuationLock);
+        m_continuation = then;
+        m_continuationState = then ? state : GST_STATE_VOID_PENDING;
     }
 
-    return gst_element_set_state(GST_ELEMENT(m_pipeline), state);
+    // Before the transition starts, cb_state has the final say once the
+    // pipeline posts its first state-changed message.
+    m_pendingState.storeRelease(state);
+    GstStateChangeReturn ret = gst_element_set_state(GST_ELEMENT(m_pipeline), state);
+    // Going on to PLAYING afterwards may well return ASYNC or SUCCESS, the
+    // source stays live until the pipeline is stopped.
+    if (state <= GST_STATE_READY) {
+        m_live.storeRelease(false);
+    } else if (ret == GST_STATE_CHANGE_NO_PREROLL) {
+        m_live.storeRelease(true);
+    }
+    switch (ret) {
+    case GST_STATE_CHANGE_SUCCESS:
+    case GST_STATE_CHANGE_NO_PREROLL:
+        // The bus is flushing on the way down to NULL, so no message tells us.
+        m_currentState.storeRelease(state);
+        m_pendingState.storeRelease(GST_STATE_VOID_PENDING);
+        reachState(state);
+        break;
+    case GST_STATE_CHANGE_FAILURE: {
+        m_pendingState.storeRelease(GST_STATE_VOID_PENDING);
+        QMutexLocker locker(&m_continuationLock);
+        m_continuation = std::function<void()>();
+        m_continuationState = GST_STATE_VOID_PENDING;
+        break;
+    }
+    case GST_STATE_CHANGE_ASYNC:
+        break;
+    }
+    return ret;
+}
+
+// Hands the continuation waiting for state, if any, to the thread of the
+// pipeline. Called from whichever thread saw the transition complete.
+void Pipeline::reachState(GstState state)
+{
+    QMutexLocker locker(&m_continuationLock);
+    if (!m_continuation || m_continuationState != state) {
+        return;
+    }
+    m_reachedContinuations << m_continuation;
+    m_continuation = std::function<void()>();
+    m_continuationState = GST_STATE_VOID_PENDING;
+    // Dropped along with us, unlike tasks passed to runInMainThread().
+    QMetaObject::invokeMethod(this, "runStateContinuations", Qt::QueuedConnection);
+}
+
+void Pipeline::runStateContinuations()
+{
+    QMutexLocker locker(&m_continuationLock);
+    const QList<std::function<void()> > continuations = m_reachedContinuations;
+    m_reachedContinuations.clear();
+    locker.unlock();
+    foreach (const std::function<void()> &continuation, continuations) {
+        continuation();
+    }
 }
 
 void Pipeline::writeToDot(MediaObject *media, const QString &type)
@@ -270,9 +553,12 @@ void Pipeline::writeToDot(MediaObject *media, const QString &type)
 
 GstState Pipeline::state() const
 {
-    GstState state;
-    gst_element_get_state(GST_ELEMENT(m_pipeline), &state, NULL, 1000);
-    return state;
+    return static_cast<GstState>(m_currentState.loadAcquire());
+}
+
+GstState Pipeline::pendingState() const
+{
+    return static_cast<GstState>(m_pendingState.loadAcquire());
 }
 
 gboolean Pipeline::cb_eos(GstBus *bus, GstMessage *gstMessage, gpointer data)
@@ -305,7 +591,7 @@ gboolean Pipeline::cb_duration(GstBus *bus, GstMessage *gstMessage, gpointer dat
     Q_UNUSED(bus)
     Q_UNUSED(gstMessage)
     Pipeline *that = static_cast<Pipeline*>(data);
-    if (that->m_resetting) {
+    if (that->m_resetting.loadAcquire()) {
         return true;
     }
 
@@ -340,10 +626,9 @@ gboolean Pipeline::cb_buffering(GstBus *bus, GstMessage *gstMessage, gpointer da
     // Instead of playing when the pipeline is still streaming, we pause
     // and let gst finish streaming.
     if ( percent < 100 && gstMessage->type == GST_MESSAGE_BUFFERING) {
-        QMetaObject::invokeMethod(that, "setState", Qt::QueuedConnection, Q_ARG(GstState, GST_STATE_PAUSED));
-
+        that->requestState(GST_STATE_PAUSED);
     } else {
-        QMetaObject::invokeMethod(that, "setState", Qt::QueuedConnection, Q_ARG(GstState, GST_STATE_PLAYING));
+        that->requestState(GST_STATE_PLAYING);
     }
 
     if (that->m_bufferPercent != percent) {
@@ -372,6 +657,32 @@ gboolean Pipeline::cb_state(GstBus *bus, GstMessage *gstMessage, gpointer data)
         return true;
     }
 
+    // Keep the cache in sync before any of the early returns below.
+    that->m_currentState.storeRelease(newState);
+    that->m_pendingState.storeRelease(pendingState);
+    if (pendingState == GST_STATE_VOID_PENDING) {
+        that->reachState(newState);
+    }
+
+    // A rate or loop set before there was anything to seek in. Normal
+    // playback does not seek after prerolling, so this is the first chance
+    // to apply it, the segment flag included.
+    if (GST_STATE_TRANSITION(oldState, newState) == GST_STATE_CHANGE_READY_TO_PAUSED &&
+        !that->m_resetting.loadAcquire()) {
+        QMutexLocker locker(&that->m_seekLock);
+        if (that->m_segmentPending) {
+            // Not from the thread posting the message, flushing could deadlock.
+            that->runAsync([that]() {
+                QMutexLocker seekLocker(&that->m_seekLock);
+                if (!that->m_segmentPending) {
+                    return;
+                }
+                seekLocker.unlock();
+                that->applySeek(that->position());
+            });
+        }
+    }
+
     // Apparently gstreamer sometimes enters the same state twice.
     // FIXME: Sometimes we enter the same state twice. currently not disallowed by the state machine
     if (that->m_seeking) {
@@ -394,10 +705,21 @@ gboolean Pipeline::cb_state(GstBus *bus, GstMessage *gstMessage, gpointer data)
 
     //FIXME: This is a hack until proper state engine is implemented in the pipeline
     // Wait to update stuff until we're at the final requested state
-    if (pendingState == GST_STATE_VOID_PENDING && newState > GST_STATE_READY && that->m_resetting) {
-        that->m_resetting = false;
-        that->seekToMSec(that->m_posAtReset);
-//        return;
+    if (that->m_resetting.loadAcquire()) {
+        if (pendingState == GST_STATE_VOID_PENDING && newState == GST_STATE_PAUSED) {
+            that->m_resetting.storeRelease(false);
+            const qint64 pos = that->m_posAtReset;
+            const GstState resume = that->m_stateAfterReset;
+            // Not from the thread posting the message, flushing could deadlock.
+            that->runAsync([that, pos, resume]() {
+                that->applySeek(pos);
+                if (resume == GST_STATE_PLAYING) {
+                    that->applyState(resume);
+                }
+            });
+        }
+        // To the frontend this is a seek, not a stop and restart.
+        return true;
     }
 
     if (pendingState == GST_STATE_VOID_PENDING) {
@@ -496,10 +818,11 @@ void Pipeline::pluginInstallStarted()
 
 void Pipeline::pluginInstallComplete()
 {
-    debug() << "Install complete." << m_resumeAfterInstall;
-    if (m_resumeAfterInstall) {
+    const bool resume = m_resumeAfterInstall.loadAcquire();
+    debug() << "Install complete." << resume;
+    if (resume) {
         setSource(m_currentSource);
-        setState(GST_STATE_PLAYING);
+        requestState(GST_STATE_PLAYING);
     }
 }
 
@@ -601,6 +924,16 @@ gboolean Pipeline::cb_tag(GstBus *bus, GstMessage *msg, gpointer data)
         gst_tag_list_foreach(tag_list, &foreach_tag_function, &newTags);
         gst_tag_list_unref(tag_list);
 
+        // Lets the reader turn watermarks given as time into bytes.
+        const QString bitrate = newTags.contains("BITRATE") ? newTags.value("BITRATE")
+                                                            : newTags.value("NOMINAL-BITRATE");
+        if (!bitrate.isEmpty()) {
+            QMutexLocker readerLocker(&that->m_readerLock);
+            if (that->m_reader) {
+                that->m_reader->setBitrate(bitrate.toUInt());
+            }
+        }
+
         // Determine if we should no fake the album/artist tags.
         // This is a little confusing as we want to fake it on initial
         // connection where title, album and artist are all missing.
@@ -710,7 +1043,8 @@ gboolean Pipeline::cb_streamStart(GstBus *bus, GstMessage *msg, gpointer data)
     g_object_get(that->m_pipeline, "uri", &uri, NULL);
     debug() << "Stream changed to" << uri;
     g_free(uri);
-    if (!that->m_resetting) {
+    that->m_anchorValid.storeRelease(false);
+    if (!that->m_resetting.loadAcquire()) {
         emit that->streamChanged();
     }
     return true;
@@ -784,15 +1118,373 @@ QList<MediaController::NavigationMenu> Pipeline::availableMenus() const
 bool Pipeline::seekToMSec(qint64 time)
 {
     m_posAtReset = time;
-    if (m_resetting) {
+    if (m_resetting.loadAcquire()) {
         return true;
     }
+    {
+        QMutexLocker locker(&m_seekLock);
+        if (m_seekInFlight) {
+            // Only the newest target is issued once the decoders settled.
+            m_pendingSeek = time;
+            return true;
+        }
+    }
+    if (m_queuedTasks.loadAcquire() > 0) {
+        // Seeking only makes sense once the queued state changes are through.
+        runAsync([this, time]() { applySeek(time); });
+        return true;
+    }
+    return applySeek(time);
+}
+
+// Rates too fast to decode every frame, played in trick mode instead.
+static bool isTrickRate(gdouble rate)
+{
+    return qAbs(rate) > MAX_TRICKLESS_RATE;
+}
+
+bool Pipeline::applySeek(qint64 time)
+{
+    m_anchorValid.storeRelease(false);
     if (state() == GST_STATE_PLAYING) {
         m_seeking = true;
     }
-    return gst_element_seek(GST_ELEMENT(m_pipeline), 1.0, GST_FORMAT_TIME,
-                     GST_SEEK_FLAG_FLUSH, GST_SEEK_TYPE_SET,
-                     time * GST_MSECOND, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+    // Below PAUSED there is no preroll, hence no ASYNC_DONE to wait for.
+    // Neither is there for live sources, which never preroll.
+    const bool async = state() >= GST_STATE_PAUSED && !m_live.loadAcquire();
+    if (async) {
+        // Set up front, the ASYNC_DONE can arrive before the call returns.
+        QMutexLocker locker(&m_seekLock);
+        m_seekInFlight = true;
+    }
+    int flags = GST_SEEK_FLAG_FLUSH;
+    switch (seekMode()) {
+    case DefaultSeek:
+        break;
+    case AccurateSeek:
+        flags |= GST_SEEK_FLAG_ACCURATE;
+        break;
+    case TrickModeSeek:
+        flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS;
+        // Fallthrough
+    case KeyFrameSeek:
+        flags |= GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_NEAREST;
+        break;
+    }
+    m_seekLock.lock();
+    const gdouble rate = m_playbackRate;
+    m_segmentPending = false;
+    // Playing backwards runs from the target down to the start.
+    GstSeekType startType = GST_SEEK_TYPE_SET;
+    gint64 start = rate > 0 ? time : 0;
+    GstSeekType stopType = rate > 0 ? GST_SEEK_TYPE_NONE : GST_SEEK_TYPE_SET;
+    gint64 stop = rate > 0 ? -1 : time;
+    if (m_looping) {
+        // Ends in SEGMENT_DONE instead of EOS, see cb_segmentDone().
+        flags |= GST_SEEK_FLAG_SEGMENT;
+        time = qMax(time, m_loopStart);
+        if (m_loopEnd >= 0) {
+            time = qMin(time, m_loopEnd);
+        }
+        start = rate > 0 ? time : m_loopStart;
+        stop = rate > 0 ? m_loopEnd : time;
+        stopType = stop >= 0 ? GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE;
+    }
+    m_seekLock.unlock();
+    if (isTrickRate(rate)) {
+        // Scanning at high speed only decodes the keyframes.
+        flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS |
+                 GST_SEEK_FLAG_TRICKMODE_NO_AUDIO;
+    }
+    const bool ok = gst_element_seek(GST_ELEMENT(m_pipeline), rate, GST_FORMAT_TIME,
+                                     GstSeekFlags(flags),
+                                     startType, start * GST_MSECOND,
+                                     stopType, stop >= 0 ? stop * GST_MSECOND : GST_CLOCK_TIME_NONE);
+    if (!ok && async) {
+        QMutexLocker locker(&m_seekLock);
+        m_seekInFlight = false;
+    }
+    return ok;
+}
+
+gdouble Pipeline::playbackRate() const
+{
+    QMutexLocker locker(&m_seekLock);
+    return m_playbackRate;
+}
+
+bool Pipeline::setPlaybackRate(gdouble rate)
+{
+    if (rate == 0.0) {
+        return false;
+    }
+    gdouble oldRate;
+    {
+        QMutexLocker locker(&m_seekLock);
+        oldRate = m_playbackRate;
+        m_playbackRate = rate;
+        if (rate != oldRate && state() < GST_STATE_PAUSED) {
+            m_segmentPending = true;
+        }
+    }
+    debug() << "Playback rate" << oldRate << "->" << rate;
+    if (rate != 1.0) {
+        insertAudioTempo();
+    }
+    if (rate == oldRate || state() < GST_STATE_PAUSED) {
+        // Applied once prerolled, see cb_state().
+        return true;
+    }
+    m_anchorValid.storeRelease(false);
+
+#if GST_CHECK_VERSION(1, 18, 0)
+    // Without trick modes or a change of direction the running segment can be
+    // kept and only its rate changed, so nothing gets flushed.
+    if (!isTrickRate(rate) && !isTrickRate(oldRate) && (rate > 0) == (oldRate > 0)) {
+        if (gst_element_seek(GST_ELEMENT(m_pipeline), rate, GST_FORMAT_TIME,
+                             GST_SEEK_FLAG_INSTANT_RATE_CHANGE,
+                             GST_SEEK_TYPE_NONE, 0, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
+            return true;
+        }
+        debug() << "Instant rate change not supported, flushing";
+    }
+#endif
+    return seekToMSec(position());
+}
+
+/*
+ * Puts scaletempo in front of the audio queue the first time a rate other than
+ * 1.0 is asked for, so the pitch is kept. Playing at the normal rate goes
+ * without it and the conversion to the float samples it works on.
+ */
+void Pipeline::insertAudioTempo()
+{
+    if (m_audioTempoInserted) {
+        return;
+    }
+    m_audioTempoInserted = true;
+    GstElement *tempo = gst_element_factory_make("scaletempo", "audioTempo");
+    if (!tempo) {
+        warning() << "scaletempo not available, playback rates change the pitch";
+        return;
+    }
+    GstElement *convert = gst_element_factory_make("audioconvert", NULL);
+    gst_bin_add_many(GST_BIN(m_audioGraph), convert, tempo, NULL);
+    gst_element_link(convert, tempo);
+    gst_element_sync_state_with_parent(convert);
+    gst_element_sync_state_with_parent(tempo);
+
+    GstPad *ghost = gst_element_get_static_pad(m_audioGraph, "sink");
+    GstPad *convertSink = gst_element_get_static_pad(convert, "sink");
+    GstPad *tempoSrc = gst_element_get_static_pad(tempo, "src");
+    GstPad *queueSink = gst_element_get_static_pad(m_audioPipe, "sink");
+    std::function<void()> task = [ghost, convertSink, tempoSrc, queueSink]() {
+        gst_ghost_pad_set_target(GST_GHOST_PAD(ghost), convertSink);
+        gst_pad_link(tempoSrc, queueSink);
+        gst_object_unref(queueSink);
+        gst_object_unref(tempoSrc);
+        gst_object_unref(convertSink);
+        gst_object_unref(ghost);
+    };
+    GstPad *feed = gst_pad_get_peer(ghost);
+    if (feed) {
+        runWhenIdle(feed, task);
+        gst_object_unref(feed);
+    } else {
+        task();
+    }
+}
+
+Pipeline::SeekMode Pipeline::seekMode() const
+{
+    return SeekMode(m_seekMode.loadAcquire());
+}
+
+void Pipeline::setSeekMode(SeekMode mode)
+{
+    debug() << "Seek mode" << mode;
+    m_seekMode.storeRelease(mode);
+}
+
+void Pipeline::setConnectedOutputs(bool audio, bool video)
+{
+    if (audio == m_hasAudioOutput && video == m_hasVideoOutput) {
+        return;
+    }
+    m_hasAudioOutput = audio;
+    m_hasVideoOutput = video;
+    updatePlayFlags();
+}
+
+void Pipeline::setSubtitlesEnabled(bool enabled)
+{
+    m_subtitlesEnabled = enabled;
+    updatePlayFlags();
+}
+
+/*
+ * Keeps playbin from decoding streams nobody consumes. Without any output
+ * connected yet nothing is restricted, playbin would fail to play at all.
+ */
+void Pipeline::updatePlayFlags()
+{
+    int flags;
+    g_object_get(m_pipeline, "flags", &flags, NULL);
+    int wanted = flags | GST_PLAY_FLAG_AUDIO | GST_PLAY_FLAG_VIDEO;
+    if (m_hasAudioOutput || m_hasVideoOutput) {
+        if (!m_hasAudioOutput) {
+            wanted &= ~GST_PLAY_FLAG_AUDIO;
+        }
+        if (!m_hasVideoOutput) {
+            wanted &= ~GST_PLAY_FLAG_VIDEO;
+        }
+    }
+    // Subtitles are rendered onto the video.
+    if (m_subtitlesEnabled && (wanted & GST_PLAY_FLAG_VIDEO)) {
+        wanted |= GST_PLAY_FLAG_TEXT;
+    } else {
+        wanted &= ~GST_PLAY_FLAG_TEXT;
+    }
+    if (wanted == flags) {
+        return;
+    }
+    debug() << "playbin flags" << flags << "->" << wanted;
+    g_object_set(m_pipeline, "flags", wanted, NULL);
+
+    // playsink reconfigures its chains on the flag change, a newly wanted
+    // stream only has data flowing into it again after a flush. Seeking in
+    // place keeps the source open, which a stream can only be once.
+    if ((wanted & ~flags) & (GST_PLAY_FLAG_AUDIO | GST_PLAY_FLAG_VIDEO) && state() > GST_STATE_READY) {
+        seekToMSec(position());
+    }
+}
+
+gboolean Pipeline::cb_streamStatus(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    Q_UNUSED(bus)
+    Q_UNUSED(data)
+    GstStreamStatusType type;
+    GstElement *owner;
+    gst_message_parse_stream_status(msg, &type, &owner);
+    if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+        // Posted from the streaming thread itself.
+        ThreadPolicy::apply(owner);
+    } else if (type == GST_STREAM_STATUS_TYPE_LEAVE) {
+        ThreadPolicy::restore();
+    }
+    return true;
+}
+
+bool Pipeline::setLoop(qint64 start, qint64 end)
+{
+    if (start < 0 || (end >= 0 && end <= start)) {
+        return false;
+    }
+    {
+        QMutexLocker locker(&m_seekLock);
+        m_looping = true;
+        m_loopStart = start;
+        m_loopEnd = end;
+        if (state() < GST_STATE_PAUSED) {
+            m_segmentPending = true;
+        }
+    }
+    debug() << "Looping from" << start << "to" << end;
+    if (state() < GST_STATE_PAUSED) {
+        // Applied once prerolled, see cb_state().
+        return true;
+    }
+    // Has to flush once to get the segment flag in place, stays put if the
+    // position already is within the loop.
+    return seekToMSec(position());
+}
+
+void Pipeline::clearLoop()
+{
+    {
+        QMutexLocker locker(&m_seekLock);
+        if (!m_looping) {
+            return;
+        }
+        m_looping = false;
+    }
+    debug() << "Not looping anymore";
+    if (state() >= GST_STATE_PAUSED) {
+        // Only a seek without the segment flag gets us an EOS at the end again.
+        seekToMSec(position());
+    }
+}
+
+bool Pipeline::isLooping() const
+{
+    QMutexLocker locker(&m_seekLock);
+    return m_looping;
+}
+
+/*
+ * Queues the next pass of the loop behind the data still being played, which
+ * is why it must not flush. Returns false if looping got disabled meanwhile.
+ */
+bool Pipeline::applyLoopSeek()
+{
+    QMutexLocker locker(&m_seekLock);
+    if (!m_looping) {
+        return false;
+    }
+    const gint64 start = m_loopStart * GST_MSECOND;
+    const gint64 stop = m_loopEnd >= 0 ? m_loopEnd * GST_MSECOND : GST_CLOCK_TIME_NONE;
+    const gdouble rate = m_playbackRate;
+    locker.unlock();
+
+    int flags = GST_SEEK_FLAG_SEGMENT | GST_SEEK_FLAG_ACCURATE;
+    if (isTrickRate(rate)) {
+        flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS |
+                 GST_SEEK_FLAG_TRICKMODE_NO_AUDIO;
+    }
+    m_anchorValid.storeRelease(false);
+    return gst_element_seek(GST_ELEMENT(m_pipeline), rate, GST_FORMAT_TIME, GstSeekFlags(flags),
+                            GST_SEEK_TYPE_SET, start,
+                            stop == gint64(GST_CLOCK_TIME_NONE) ? GST_SEEK_TYPE_NONE : GST_SEEK_TYPE_SET, stop);
+}
+
+gboolean Pipeline::cb_segmentDone(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    Q_UNUSED(bus)
+    Pipeline *that = static_cast<Pipeline*>(data);
+    if (msg->src != GST_OBJECT(that->m_pipeline)) {
+        return true;
+    }
+    debug() << "Segment done";
+    that->runAsync([that]() {
+        if (!that->applyLoopSeek()) {
+            // The loop was cleared before its end was reached.
+            that->applySeek(that->position());
+        }
+    });
+    return true;
+}
+
+gboolean Pipeline::cb_asyncDone(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    Q_UNUSED(bus)
+    Pipeline *that = static_cast<Pipeline*>(data);
+    if (msg->src != GST_OBJECT(that->m_pipeline)) {
+        return true;
+    }
+    QMutexLocker locker(&that->m_seekLock);
+    if (!that->m_seekInFlight) {
+        return true;
+    }
+    if (that->m_pendingSeek < 0) {
+        that->m_seekInFlight = false;
+        return true;
+    }
+    const qint64 time = that->m_pendingSeek;
+    that->m_pendingSeek = -1;
+    // Stays in flight, but a flushing seek must not be issued from the
+    // thread that posted this.
+    that->runAsync([that, time]() { that->applySeek(time); });
+    return true;
 }
 
 bool Pipeline::isSeekable() const
@@ -831,31 +1523,6 @@ Phonon::State Pipeline::phononState() const
     return Phonon::ErrorState;
 }
 
-static void cb_feedAppSrc(GstAppSrc *appSrc, guint buffsize, gpointer data)
-{
-    DEBUG_BLOCK;
-    StreamReader *reader = static_cast<StreamReader*>(data);
-    GstBuffer *buf = gst_buffer_new_and_alloc(buffsize);
-
-    GstMapInfo info;
-    gst_buffer_map(buf, &info, GST_MAP_WRITE);
-    #warning return value not used!!! WHOOPWHOOPWHOOP
-    reader->read(reader->currentPos(), info.size, (char*)info.data);
-    gst_buffer_unmap(buf, &info);
-    gst_app_src_push_buffer(appSrc, buf);
-    if (info.size > 0 && reader->atEnd()) {
-        gst_app_src_end_of_stream(appSrc);
-    }
-}
-
-static void cb_seekAppSrc(GstAppSrc *appSrc, guint64 pos, gpointer data)
-{
-    Q_UNUSED(appSrc);
-    DEBUG_BLOCK;
-    StreamReader *reader = static_cast<StreamReader*>(data);
-    reader->setCurrentPos(pos);
-}
-
 void Pipeline::cb_setupSource(GstElement *playbin, GParamSpec *param, gpointer data)
 {
     Q_UNUSED(playbin);
@@ -868,6 +1535,7 @@ void Pipeline::cb_setupSource(GstElement *playbin, GParamSpec *param, gpointer d
     Q_ASSERT(G_IS_OBJECT(that->m_pipeline));
     g_object_get(that->m_pipeline, "source", &phononSrc, NULL);
 
+    QMutexLocker locker(&that->m_readerLock);
     if (that->m_reader) {
         // Because libphonon stream stuff likes to fail connection asserts
         // we force a complete reset.
@@ -877,21 +1545,9 @@ void Pipeline::cb_setupSource(GstElement *playbin, GParamSpec *param, gpointer d
     }
 
     if (that->m_isStream) {
-        that->m_reader = new StreamReader(that->m_currentSource, that);
+        that->m_reader = new StreamReader(that->m_currentSource);
         that->m_reader->start();
-        if (that->m_reader->streamSize() > 0) {
-            g_object_set(phononSrc, "size", that->m_reader->streamSize(), NULL);
-        }
-        int streamType = 0;
-        if (that->m_reader->streamSeekable()) {
-            streamType = GST_APP_STREAM_TYPE_SEEKABLE;
-        } else {
-            streamType = GST_APP_STREAM_TYPE_STREAM;
-        }
-        g_object_set(phononSrc, "stream-type", streamType, NULL);
-        g_object_set(phononSrc, "block", TRUE, NULL);
-        g_signal_connect(phononSrc, "need-data", G_CALLBACK(cb_feedAppSrc), that->m_reader);
-        g_signal_connect(phononSrc, "seek-data", G_CALLBACK(cb_seekAppSrc), that->m_reader);
+        that->m_reader->setupAppSrc(GST_APP_SRC(phononSrc));
     } else {
         if (that->currentSource().type() == MediaSource::Url
                 && that->currentSource().mrl().scheme().startsWith(QLatin1String("http"))
@@ -923,7 +1579,7 @@ Phonon::MediaSource Pipeline::currentSource() const
 
 qint64 Pipeline::position() const
 {
-    if (m_resetting) {
+    if (m_resetting.loadAcquire()) {
         return m_posAtReset;
     }
 
@@ -932,6 +1588,243 @@ qint64 Pipeline::position() const
     return (pos / GST_MSECOND);
 }
 
+qint64 Pipeline::estimatedPosition()
+{
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(m_pipeline));
+    if (!clock) {
+        return position();
+    }
+    const GstClockTime now = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+
+    if (state() != GST_STATE_PLAYING || m_resetting.loadAcquire() || !m_anchorValid.loadAcquire() ||
+        !GST_CLOCK_TIME_IS_VALID(m_anchorTime) || now - m_anchorTime >= POSITION_REQUERY_INTERVAL) {
+        m_anchorPos = position();
+        m_anchorDuration = totalDuration();
+        m_anchorTime = now;
+        m_anchorRate = segmentRate();
+        m_anchorValid.storeRelease(true);
+        return m_anchorPos;
+    }
+
+    qint64 pos = m_anchorPos + qint64((now - m_anchorTime) * m_anchorRate) / GST_MSECOND;
+    if (m_anchorDuration > 0 && pos > m_anchorDuration) {
+        pos = m_anchorDuration;
+    }
+    return qMax<qint64>(pos, 0);
+}
+
+gdouble Pipeline::segmentRate() const
+{
+    gdouble rate = 1.0;
+    GstQuery *query = gst_query_new_segment(GST_FORMAT_TIME);
+    if (gst_element_query(GST_ELEMENT(m_pipeline), query)) {
+        gst_query_parse_segment(query, &rate, NULL, NULL, NULL);
+    }
+    gst_query_unref(query);
+    return rate;
+}
+
+struct AlarmData
+{
+    ClockContext *context;
+    int alarm;
+    quint32 serial;
+};
+
+static void freeAlarmData(gpointer data)
+{
+    AlarmData *alarm = static_cast<AlarmData*>(data);
+    unrefClockContext(alarm->context);
+    delete alarm;
+}
+
+bool Pipeline::setPositionAlarm(int alarm, qint64 target, qint64 from)
+{
+    clearPositionAlarm(alarm);
+    // Not the rate of the running segment, which still is the old one right
+    // after setPlaybackRate().
+    const gdouble rate = playbackRate();
+    if (rate <= 0) {
+        // Playing backwards or not at all, the target is never reached.
+        return false;
+    }
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(m_pipeline));
+    if (!clock) {
+        return false;
+    }
+    if (from < 0) {
+        from = position();
+    }
+    const GstClockTime delay = qMax<qint64>(target - from, 0) * GST_MSECOND / rate;
+
+    PositionAlarm entry;
+    entry.clockId = gst_clock_new_single_shot_id(clock, gst_clock_get_time(clock) + delay);
+    entry.serial = ++m_alarmSerial;
+    gst_object_unref(clock);
+
+    AlarmData *data = new AlarmData;
+    data->context = refClockContext(m_clockContext);
+    data->alarm = alarm;
+    data->serial = entry.serial;
+    if (gst_clock_id_wait_async(entry.clockId, cb_positionAlarm, data, freeAlarmData) != GST_CLOCK_OK) {
+        gst_clock_id_unref(entry.clockId);
+        return false;
+    }
+    m_alarms.insert(alarm, entry);
+    return true;
+}
+
+void Pipeline::clearPositionAlarm(int alarm)
+{
+    QHash<int, PositionAlarm>::iterator it = m_alarms.find(alarm);
+    if (it == m_alarms.end()) {
+        return;
+    }
+    gst_clock_id_unschedule(it->clockId);
+    gst_clock_id_unref(it->clockId);
+    m_alarms.erase(it);
+}
+
+gboolean Pipeline::cb_positionAlarm(GstClock *clock, GstClockTime time, GstClockID id, gpointer data)
+{
+    Q_UNUSED(clock)
+    Q_UNUSED(time)
+    Q_UNUSED(id)
+    AlarmData *alarm = static_cast<AlarmData*>(data);
+    QMutexLocker locker(&alarm->context->lock);
+    if (alarm->context->pipeline) {
+        QMetaObject::invokeMethod(alarm->context->pipeline, "handlePositionAlarm", Qt::QueuedConnection,
+                                  Q_ARG(int, alarm->alarm), Q_ARG(uint, alarm->serial));
+    }
+    return TRUE;
+}
+
+void Pipeline::handlePositionAlarm(int alarm, uint serial)
+{
+    // Ignore alarms that got cleared or replaced while this one was queued.
+    QHash<int, PositionAlarm>::iterator it = m_alarms.find(alarm);
+    if (it == m_alarms.end() || it->serial != serial) {
+        return;
+    }
+    gst_clock_id_unref(it->clockId);
+    m_alarms.erase(it);
+    emit positionAlarm(alarm);
+}
+
+bool Pipeline::startTicks(int interval)
+{
+    stopTicks();
+    GstClock *clock = interval > 0 ? gst_element_get_clock(GST_ELEMENT(m_pipeline)) : NULL;
+    if (!clock) {
+        return false;
+    }
+    const GstClockTime period = interval * GST_MSECOND;
+    m_tickId = gst_clock_new_periodic_id(clock, gst_clock_get_time(clock) + period, period);
+    gst_object_unref(clock);
+    m_tickPending.storeRelease(false);
+    if (gst_clock_id_wait_async(m_tickId, cb_clockTick, refClockContext(m_clockContext),
+                                unrefClockContext) != GST_CLOCK_OK) {
+        gst_clock_id_unref(m_tickId);
+        m_tickId = 0;
+        return false;
+    }
+    return true;
+}
+
+void Pipeline::stopTicks()
+{
+    if (m_tickId) {
+        gst_clock_id_unschedule(m_tickId);
+        gst_clock_id_unref(m_tickId);
+        m_tickId = 0;
+    }
+}
+
+gboolean Pipeline::cb_clockTick(GstClock *clock, GstClockTime time, GstClockID id, gpointer data)
+{
+    Q_UNUSED(clock)
+    Q_UNUSED(time)
+    Q_UNUSED(id)
+    ClockContext *context = static_cast<ClockContext*>(data);
+    QMutexLocker locker(&context->lock);
+    Pipeline *that = context->pipeline;
+    // A busy GUI thread gets one tick, not a backlog of them.
+    if (that && that->m_tickPending.testAndSetOrdered(false, true)) {
+        QMetaObject::invokeMethod(that, "handleClockTick", Qt::QueuedConnection);
+    }
+    return TRUE;
+}
+
+struct IdleTask
+{
+    Pipeline *pipeline;
+    std::function<void()> task;
+    std::function<void()> done;
+};
+
+static void cb_idleDestroy(gpointer data)
+{
+    delete static_cast<IdleTask*>(data);
+}
+
+// Runs in the streaming thread once no buffer is on its way through the pad
+// anymore, or right away in ours if there was none to begin with.
+static GstPadProbeReturn cb_idle(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    Q_UNUSED(pad);
+    Q_UNUSED(info);
+    IdleTask *idle = static_cast<IdleTask*>(data);
+    if (idle->task) {
+        idle->task();
+    }
+    if (idle->done) {
+        idle->pipeline->runInMainThread(idle->done);
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
+void Pipeline::runWhenIdle(GstPad *pad, const std::function<void()> &task, const std::function<void()> &done)
+{
+    IdleTask *idle = new IdleTask;
+    idle->pipeline = this;
+    idle->task = task;
+    idle->done = done;
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_IDLE, cb_idle, idle, cb_idleDestroy);
+}
+
+void Pipeline::runInMainThread(const std::function<void()> &task)
+{
+    if (QThread::currentThread() == thread()) {
+        task();
+        return;
+    }
+    QMutexLocker locker(&m_mainThreadLock);
+    m_mainThreadTasks << task;
+    if (m_mainThreadTasks.size() == 1) {
+        QMetaObject::invokeMethod(this, "runMainThreadTasks", Qt::QueuedConnection);
+    }
+}
+
+void Pipeline::runMainThreadTasks()
+{
+    QMutexLocker locker(&m_mainThreadLock);
+    const QList<std::function<void()> > tasks = m_mainThreadTasks;
+    m_mainThreadTasks.clear();
+    locker.unlock();
+    foreach (const std::function<void()> &task, tasks) {
+        task();
+    }
+}
+
+void Pipeline::handleClockTick()
+{
+    m_tickPending.storeRelease(false);
+    if (m_tickId) {
+        emit clockTick();
+    }
+}
+
 QByteArray Pipeline::captureDeviceURI(const MediaSource &source) const
 {
 #ifndef PHONON_NO_AUDIOCAPTURE
@@ -22,8 +22,14 @@
 #include <gst/gst.h>
 #include <phonon/MediaSource>
 #include <phonon/MediaController>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QHash>
 #include <QtCore/QMutex>
 
+#include <functional>
+
+class QThreadPool;
+
 typedef QMultiMap<QString, QString> TagMap;
 
 namespace Phonon
@@ -34,12 +40,26 @@ namespace Gstreamer
 class MediaObject;
 class PluginInstaller;
 class StreamReader;
+struct ClockContext;
 
 class Pipeline : public QObject
 {
     Q_OBJECT
 
     public:
+        // How seeks position the stream.
+        enum SeekMode {
+            // Leaves the precision to the demuxer, as seeking always did.
+            DefaultSeek,
+            // Decodes up to the exact target.
+            AccurateSeek,
+            // Snaps to the nearest keyframe, cheap for scrubbing long-GOP content.
+            KeyFrameSeek,
+            // As KeyFrameSeek, but decoders also skip everything except
+            // keyframes until the next seek.
+            TrickModeSeek
+        };
+
         Pipeline(QObject *parent = 0);
         virtual ~Pipeline();
         GstElement *element() const;
@@ -50,8 +70,24 @@ class Pipeline : public QObject
         GstElement *audioPipe() const;
         GstElement *videoPipe() const;
 
-        Q_INVOKABLE GstStateChangeReturn setState(GstState state);
+        /*
+         * Queues a state change on the state worker, completion is reported
+         * through stateChanged(). then runs in the thread the pipeline lives
+         * in once the state got reached, or never if the transition failed or
+         * a later one got applied first.
+         */
+        void requestState(GstState state, const std::function<void()> &then = std::function<void()>());
+        /*
+         * Queues a state change behind whatever the state worker still has to
+         * do and waits up to timeout for it to complete, prerolling included.
+         * Returns GST_STATE_CHANGE_ASYNC if the transition is still under way
+         * when the timeout passed.
+         */
+        GstStateChangeReturn requestStateAndWait(GstState state, GstClockTime timeout);
+        // Last state reported by the pipeline, never blocks.
         GstState state() const;
+        // State a transition in progress is heading for, GST_STATE_VOID_PENDING if there is none.
+        GstState pendingState() const;
         Phonon::MediaSource currentSource() const;
         void writeToDot(MediaObject *media, const QString &type);
         qint64 totalDuration() const;
@@ -65,11 +101,21 @@ class Pipeline : public QObject
         static gboolean cb_error(GstBus *bus, GstMessage *msg, gpointer data);
         static gboolean cb_tag(GstBus *bus, GstMessage *msg, gpointer data);
         static gboolean cb_streamStart(GstBus *bus, GstMessage *msg, gpointer data);
+        static gboolean cb_asyncDone(GstBus *bus, GstMessage *msg, gpointer data);
+        static gboolean cb_segmentDone(GstBus *bus, GstMessage *msg, gpointer data);
+        static gboolean cb_streamStatus(GstBus *bus, GstMessage *msg, gpointer data);
 
         static void cb_aboutToFinish(GstElement *appSrc, gpointer data);
         static void cb_endOfPads(GstElement *playbin, gpointer data);
 
         void setSource(const Phonon::MediaSource &source, bool reset = false);
+        // Hands playbin the next source from the about-to-finish handler,
+        // which runs in a streaming thread. Only sources playbin opens on its
+        // own qualify, for any other nothing is touched and false returned.
+        bool setGaplessUri(const Phonon::MediaSource &source);
+        // Catches up with a source handed over through setGaplessUri(), from
+        // the thread the pipeline lives in.
+        void adoptGaplessSource(const Phonon::MediaSource &source);
 
         static void cb_videoChanged(GstElement *playbin, gpointer data);
         static void cb_textTagsChanged(GstElement *playbin, gint stream, gpointer data);
@@ -86,12 +132,63 @@ class Pipeline : public QObject
         void updateNavigation();
 
         bool seekToMSec(qint64 time);
+        SeekMode seekMode() const;
+        // Applies to every seek issued from now on.
+        void setSeekMode(SeekMode mode);
+        gdouble playbackRate() const;
+        /*
+         * Plays at rate times the normal speed, backwards if negative. Up to
+         * twice the speed every frame is decoded and audio keeps its pitch,
+         * beyond that only keyframes get decoded and audio is dropped.
+         */
+        bool setPlaybackRate(gdouble rate);
+        /*
+         * Repeats the range from start to end ms, end -1 meaning the end of
+         * the stream, through segment seeks. Wrapping around neither flushes
+         * nor changes the state, so the loop is seamless.
+         */
+        bool setLoop(qint64 start, qint64 end = -1);
+        // Which kinds of outputs the media object feeds, streams without
+        // one are not decoded.
+        void setConnectedOutputs(bool audio, bool video);
+        void setSubtitlesEnabled(bool enabled);
+        // Runs task in the thread the pipeline lives in, right away when
+        // called from there and through a queued call from any other.
+        void runInMainThread(const std::function<void()> &task);
+        // Runs task in between two buffers passing pad without waiting for
+        // it, done follows in the thread of the pipeline once task ran.
+        void runWhenIdle(GstPad *pad, const std::function<void()> &task,
+                         const std::function<void()> &done = std::function<void()>());
+        void clearLoop();
+        bool isLooping() const;
         bool isSeekable() const;
 
         Phonon::State phononState() const;
         static void cb_setupSource(GstElement *playbin, GParamSpec *spec, gpointer data);
 
         qint64 position() const;
+
+        // Position interpolated from the pipeline clock, only queried now and then.
+        qint64 estimatedPosition();
+
+        /*
+         * Emits clockTick() every interval ms driven by the pipeline clock.
+         * Fails if the pipeline has no clock yet, i.e. before PAUSED.
+         */
+        bool startTicks(int interval);
+        void stopTicks();
+        static gboolean cb_clockTick(GstClock *clock, GstClockTime time, GstClockID id, gpointer data);
+
+        /*
+         * Emits positionAlarm(alarm) once playback reaches target ms, using a
+         * single-shot GstClockID. The wakeup time is computed from the
+         * position, or from if given, and the segment rate, so alarms need to
+         * be set again after seeks and rate or duration changes.
+         */
+        bool setPositionAlarm(int alarm, qint64 target, qint64 from = -1);
+        void clearPositionAlarm(int alarm);
+        static gboolean cb_positionAlarm(GstClock *clock, GstClockTime time, GstClockID id, gpointer data);
+
         QByteArray captureDeviceURI(const MediaSource &source) const;
 
     signals:
@@ -113,6 +210,8 @@ class Pipeline : public QObject
         void seekableChanged(bool isSeekable);
         void aboutToFinish();
         void streamChanged();
+        void clockTick();
+        void positionAlarm(int alarm);
 
     private:
         GstPipeline *m_pipeline;
@@ -121,7 +220,8 @@ class Pipeline : public QObject
         // Keeps track of whether or not we jump to GST_STATE_PLAYING after plugin installation is finished.
         // Otherwise, it is possible to jump to another track, play a few seconds, pause, then finish installation
         // and spontaniously start playback without user action.
-        bool m_resumeAfterInstall;
+        // Written from the state worker.
+        QAtomicInt m_resumeAfterInstall;
         // Determines if we're using an QIODevice stream
         bool m_isStream;
         bool m_isHttpUrl;
@@ -130,20 +230,102 @@ class Pipeline : public QObject
         Phonon::MediaSource m_currentSource;
         PluginInstaller *m_installer;
         StreamReader *m_reader;
+        // Guards m_reader, which the state worker stops and whichever thread
+        // sets up the source replaces.
+        QMutex m_readerLock;
         GstElement *m_audioGraph;
         GstElement *m_videoGraph;
         GstElement *m_audioPipe;
         GstElement *m_videoPipe;
 
         bool m_seeking;
-        bool m_resetting;
+        // Written by the GUI thread, the state worker and the bus.
+        QAtomicInt m_resetting;
         qint64 m_posAtReset;
+        // State to return to once a reset prerolled at m_posAtReset.
+        GstState m_stateAfterReset;
         QMutex m_tagLock;
 
+        // Written from whichever thread posts the state-changed message.
+        QAtomicInt m_currentState;
+        QAtomicInt m_pendingState;
+        // A transition since the pipeline was last stopped returned
+        // NO_PREROLL, so no ASYNC_DONE follows seeks either.
+        QAtomicInt m_live;
+
+        // Runs state changes, and seeks issued while those are queued, one
+        // after another so the GUI thread never blocks on a transition
+        // unless it asks to through requestStateAndWait().
+        QThreadPool *m_stateWorker;
+        QAtomicInt m_queuedTasks;
+        void runAsync(const std::function<void()> &task);
+        // reset is set for the transitions of a reset itself, which leave it
+        // in progress, see setSource().
+        GstStateChangeReturn applyState(GstState state, const std::function<void()> &then = std::function<void()>(),
+                                        bool reset = false);
+
+        // Continuation of the transition applied last, see requestState().
+        QMutex m_continuationLock;
+        std::function<void()> m_continuation;
+        GstState m_continuationState;
+        QList<std::function<void()> > m_reachedContinuations;
+        void reachState(GstState state);
+        bool applySeek(qint64 time);
+
+        // A flushing seek is in flight until its ASYNC_DONE arrives, seeks
+        // requested meanwhile only replace the pending target.
+        mutable QMutex m_seekLock;
+        bool m_seekInFlight;
+        qint64 m_pendingSeek;
+        QAtomicInt m_seekMode;
+        // Guarded by m_seekLock.
+        gdouble m_playbackRate;
+        bool m_looping;
+        qint64 m_loopStart;
+        qint64 m_loopEnd;
+        // Rate or loop set below PAUSED, when there is nothing to seek in
+        // yet. The first flushing seek applies the segment, see cb_state().
+        bool m_segmentPending;
+        bool applyLoopSeek();
+        // Only touched from the thread the pipeline lives in.
+        bool m_audioTempoInserted;
+        void insertAudioTempo();
+
+        bool m_hasAudioOutput;
+        bool m_hasVideoOutput;
+        bool m_subtitlesEnabled;
+        void updatePlayFlags();
+
+        // Handed to the async clock waits, which can fire while we are torn down.
+        ClockContext *m_clockContext;
+        GstClockID m_tickId;
+        QAtomicInt m_tickPending;
+        // Last queried position and the clock time and rate it was taken at.
+        QAtomicInt m_anchorValid;
+        qint64 m_anchorPos;
+        qint64 m_anchorDuration;
+        GstClockTime m_anchorTime;
+        gdouble m_anchorRate;
+        gdouble segmentRate() const;
+
+        struct PositionAlarm {
+            GstClockID clockId;
+            quint32 serial;
+        };
+        QHash<int, PositionAlarm> m_alarms;
+        quint32 m_alarmSerial;
+
+        QMutex m_mainThreadLock;
+        QList<std::function<void()> > m_mainThreadTasks;
+
     private Q_SLOTS:
         void pluginInstallFailure(const QString &msg);
         void pluginInstallComplete();
         void pluginInstallStarted();
+        void handleClockTick();
+        void handlePositionAlarm(int alarm, uint serial);
+        void runMainThreadTasks();
+        void runStateContinuations();
 
 };
 
@@ -0,0 +1,113 @@
+/*  This file is part of the KDE project.
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2.1 or 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "streambuffer.h"
+
+#include <string.h>
+
+namespace Phonon
+{
+namespace Gstreamer
+{
+
+StreamBuffer::StreamBuffer(int slotCapacity)
+    : m_slots(qMax(slotCapacity, 1))
+    , m_head(0)
+    , m_count(0)
+    , m_headOffset(0)
+    , m_size(0)
+{
+}
+
+void StreamBuffer::append(const QByteArray &chunk)
+{
+    if (chunk.isEmpty()) {
+        return;
+    }
+    if (isFull()) {
+        // The producer ignored the backpressure, the data still has to be kept.
+        m_slots[(m_head + m_count - 1) % m_slots.size()].append(chunk);
+    } else {
+        m_slots[(m_head + m_count) % m_slots.size()] = chunk;
+        ++m_count;
+    }
+    m_size += chunk.size();
+}
+
+/*
+ * Copies up to length bytes into data and releases every chunk that got
+ * consumed completely. Passing a null data pointer only drops the bytes.
+ */
+int StreamBuffer::read(char *data, int length)
+{
+    int done = 0;
+    while (done < length && m_count > 0) {
+        QByteArray &chunk = m_slots[m_head];
+        const int available = chunk.size() - m_headOffset;
+        const int bytes = qMin(available, length - done);
+        if (data) {
+            memcpy(data + done, chunk.constData() + m_headOffset, bytes);
+        }
+        done += bytes;
+        if (bytes == available) {
+            chunk = QByteArray();
+            m_head = (m_head + 1) % m_slots.size();
+            m_headOffset = 0;
+            --m_count;
+        } else {
+            m_headOffset += bytes;
+        }
+    }
+    m_size -= done;
+    return done;
+}
+
+/*
+ * Hands out the unread part of the head chunk, but at most maxLength bytes of
+ * it, without copying any data. The caller gets a shared reference to the
+ * whole chunk plus the offset at which its bytes start.
+ */
+int StreamBuffer::takeChunk(int maxLength, QByteArray *chunk, int *offset)
+{
+    if (m_count == 0 || maxLength <= 0) {
+        return 0;
+    }
+    const QByteArray &head = m_slots[m_head];
+    const int bytes = qMin(head.size() - m_headOffset, maxLength);
+    *chunk = head;
+    *offset = m_headOffset;
+    return read(0, bytes);
+}
+
+int StreamBuffer::skip(int length)
+{
+    return read(0, length);
+}
+
+void StreamBuffer::clear()
+{
+    for (int i = 0; i < m_count; ++i) {
+        m_slots[(m_head + i) % m_slots.size()] = QByteArray();
+    }
+    m_head = 0;
+    m_count = 0;
+    m_headOffset = 0;
+    m_size = 0;
+}
+
+}
+}
@@ -0,0 +1,68 @@
+/*  This file is part of the KDE project.
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2.1 or 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PHONON_GSTREAMER_STREAMBUFFER_H
+#define PHONON_GSTREAMER_STREAMBUFFER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QVector>
+
+namespace Phonon
+{
+namespace Gstreamer
+{
+
+/*
+ * Chunked ring buffer used by the StreamReader.
+ *
+ * Every chunk handed to append() is kept as an implicitly shared QByteArray in
+ * a ring of slots, so producing and consuming are O(1) and bytes that have not
+ * been read yet are never moved or copied around inside the buffer.
+ * The ring has a fixed number of slots and never grows. Once it is full the
+ * owner is expected to hold off the producer, a chunk arriving regardless gets
+ * appended to the last slot, which copies that chunk but keeps the ring bounded.
+ *
+ * This class is not thread safe, the StreamReader serializes all access.
+ */
+class StreamBuffer
+{
+public:
+    explicit StreamBuffer(int slotCapacity = 1024);
+
+    void append(const QByteArray &chunk);
+    int read(char *data, int length);
+    int takeChunk(int maxLength, QByteArray *chunk, int *offset);
+    int skip(int length);
+    void clear();
+
+    int size() const { return m_size; }
+    bool isEmpty() const { return m_size == 0; }
+    bool isFull() const { return m_count == m_slots.size(); }
+
+private:
+    QVector<QByteArray> m_slots;
+    int m_head;
+    int m_count;
+    // Offset of the first unread byte inside the head chunk.
+    int m_headOffset;
+    int m_size;
+};
+
+}
+}
+
+#endif // PHONON_GSTREAMER_STREAMBUFFER_H
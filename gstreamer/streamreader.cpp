@@ -19,26 +19,210 @@
 #include "streamreader.h"
 
 #include "debug.h"
+
+#include <QtCore/QElapsedTimer>
+
 #ifndef QT_NO_PHONON_ABSTRACTMEDIASTREAM
+
+// Default buffer watermarks, can be overridden through PHONON_GST_STREAM_WATERMARKS
+#define DEFAULT_LOW_WATERMARK 64 * 1024
+#define DEFAULT_HIGH_WATERMARK 512 * 1024
+// Default size of the seek-range cache, can be overridden through PHONON_GST_STREAM_CACHE_SIZE
+#define DEFAULT_CACHE_SIZE 2 * 1024 * 1024
+
 namespace Phonon
 {
 namespace Gstreamer
 {
 
-StreamReader::StreamReader(const Phonon::MediaSource &source, Pipeline *parent)
+/*
+ * Parses watermarks of the form "low,high", where both values are either
+ * bytes or carry an "ms" suffix, e.g. "65536,524288" or "500ms,4000ms".
+ */
+static bool parseWatermarks(const QByteArray &value, int *low, int *high, bool *inMSec)
+{
+    const QList<QByteArray> marks = value.trimmed().toLower().split(',');
+    if (marks.size() != 2) {
+        return false;
+    }
+    QByteArray lowValue = marks.at(0).trimmed();
+    QByteArray highValue = marks.at(1).trimmed();
+    *inMSec = lowValue.endsWith("ms");
+    if (highValue.endsWith("ms") != *inMSec) {
+        return false;
+    }
+    if (*inMSec) {
+        lowValue.chop(2);
+        highValue.chop(2);
+    }
+    bool lowOk = false;
+    bool highOk = false;
+    *low = lowValue.toInt(&lowOk);
+    *high = highValue.toInt(&highOk);
+    return lowOk && highOk && *low >= 0 && *high > *low;
+}
+
+static void releaseChunk(gpointer data)
+{
+    delete static_cast<QByteArray *>(data);
+}
+
+/*
+ * Wraps size bytes starting at offset of a chunk delivered through writeData()
+ * as read-only GstMemory. The memory keeps a reference on the QByteArray, so
+ * the data stays valid until GStreamer is done with it and is never copied.
+ */
+static GstMemory *wrapChunk(const QByteArray &chunk, int offset, int size)
+{
+    QByteArray *ref = new QByteArray(chunk);
+    return gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
+                                  const_cast<char *>(ref->constData()), ref->size(),
+                                  offset, size, ref, releaseChunk);
+}
+
+StreamReader::StreamReader(const Phonon::MediaSource &source)
     : m_pos(0)
     , m_size(0)
     , m_eos(false)
     , m_locked(false)
     , m_seekable(false)
-    , m_pipeline(parent)
+    , m_appSrc(0)
+    , m_pushing(false)
+    , m_lowMark(DEFAULT_LOW_WATERMARK)
+    , m_highMark(DEFAULT_HIGH_WATERMARK)
+    , m_marksInMSec(false)
+    , m_bitrate(0)
+    , m_requesting(false)
+    , m_answered(false)
+    , m_bufferPos(0)
+    , m_cacheLimit(DEFAULT_CACHE_SIZE)
+    , m_cacheBytes(0)
+    , m_cacheClock(0)
+    , m_cacheHits(0)
+    , m_cacheMisses(0)
+    , m_partialMinChunk(0)
+    , m_partialTimeout(0)
+    , m_dataRequests(0)
+    , m_lockWaitTime(0)
+    , m_dataWaitTime(0)
 {
+    const QByteArray marks = qgetenv("PHONON_GST_STREAM_WATERMARKS");
+    if (!marks.isEmpty()) {
+        int low = 0;
+        int high = 0;
+        bool inMSec = false;
+        if (parseWatermarks(marks, &low, &high, &inMSec)) {
+            setWatermarks(low, high, inMSec);
+        } else {
+            warning() << "Ignoring invalid PHONON_GST_STREAM_WATERMARKS" << marks;
+        }
+    }
+    const QByteArray cacheSize = qgetenv("PHONON_GST_STREAM_CACHE_SIZE");
+    if (!cacheSize.isEmpty()) {
+        bool ok = false;
+        const int limit = cacheSize.toInt(&ok);
+        if (ok && limit >= 0) {
+            m_cacheLimit = limit;
+        } else {
+            warning() << "Ignoring invalid PHONON_GST_STREAM_CACHE_SIZE" << cacheSize;
+        }
+    }
+    // "minchunk,timeout", e.g. "4096,100" delivers once 4 KiB are buffered or
+    // whatever arrived within the first 100 ms.
+    const QByteArray partialReads = qgetenv("PHONON_GST_STREAM_PARTIAL_READ");
+    if (!partialReads.isEmpty()) {
+        const QList<QByteArray> partial = partialReads.split(',');
+        bool chunkOk = false;
+        bool timeoutOk = false;
+        const int minChunk = partial.size() == 2 ? partial.at(0).trimmed().toInt(&chunkOk) : 0;
+        const int timeout = partial.size() == 2 ? partial.at(1).trimmed().toInt(&timeoutOk) : 0;
+        if (chunkOk && timeoutOk && minChunk >= 0 && timeout >= 0) {
+            setPartialReads(minChunk, timeout);
+        } else {
+            warning() << "Ignoring invalid PHONON_GST_STREAM_PARTIAL_READ" << partialReads;
+        }
+    }
     connectToSource(source);
 }
 
+static void cb_feedAppSrc(GstAppSrc *appSrc, guint buffsize, gpointer data)
+{
+    DEBUG_BLOCK;
+    StreamReader *reader = static_cast<StreamReader*>(data);
+    GstBuffer *buf = 0;
+    GstFlowReturn ret = reader->read(reader->currentPos(), buffsize, &buf);
+    if (ret != GST_FLOW_OK) {
+        debug() << "Ending stream, read returned" << gst_flow_get_name(ret);
+        gst_app_src_end_of_stream(appSrc);
+        return;
+    }
+    // appsrc takes ownership of the buffer.
+    gst_app_src_push_buffer(appSrc, buf);
+    if (reader->atEnd() && reader->currentBufferSize() == 0) {
+        gst_app_src_end_of_stream(appSrc);
+    }
+}
+
+static void cb_needAppSrcData(GstAppSrc *appSrc, guint length, gpointer data)
+{
+    Q_UNUSED(appSrc);
+    Q_UNUSED(length);
+    StreamReader *reader = static_cast<StreamReader*>(data);
+    reader->setDataWanted(true);
+}
+
+static void cb_enoughAppSrcData(GstAppSrc *appSrc, gpointer data)
+{
+    Q_UNUSED(appSrc);
+    StreamReader *reader = static_cast<StreamReader*>(data);
+    reader->setDataWanted(false);
+}
+
+static gboolean cb_seekAppSrc(GstAppSrc *appSrc, guint64 pos, gpointer data)
+{
+    Q_UNUSED(appSrc);
+    DEBUG_BLOCK;
+    StreamReader *reader = static_cast<StreamReader*>(data);
+    reader->setCurrentPos(pos);
+    return TRUE;
+}
+
 StreamReader::~StreamReader()
 {
     DEBUG_BLOCK;
+    clearCache();
+    if (m_appSrc) {
+        gst_object_unref(m_appSrc);
+    }
+}
+
+void StreamReader::setupAppSrc(GstAppSrc *appSrc)
+{
+    if (streamSize() > 0) {
+        g_object_set(appSrc, "size", streamSize(), NULL);
+    }
+    int streamType = 0;
+    if (streamSeekable()) {
+        streamType = GST_APP_STREAM_TYPE_SEEKABLE;
+    } else {
+        streamType = GST_APP_STREAM_TYPE_STREAM;
+    }
+    g_object_set(appSrc, "stream-type", streamType, NULL);
+    if (streamType == GST_APP_STREAM_TYPE_STREAM) {
+        // Without random access there is no point in waiting for the appsrc
+        // to ask for a specific amount of data. Forward whatever the
+        // frontend writes as soon as it arrives and leave backpressure to
+        // the appsrc queue watermarks, so a short read of the frontend
+        // never stalls the streaming thread.
+        g_object_set(appSrc, "block", FALSE, NULL);
+        setPushMode(appSrc);
+        g_signal_connect(appSrc, "need-data", G_CALLBACK(cb_needAppSrcData), this);
+        g_signal_connect(appSrc, "enough-data", G_CALLBACK(cb_enoughAppSrcData), this);
+    } else {
+        g_object_set(appSrc, "block", TRUE, NULL);
+        g_signal_connect(appSrc, "need-data", G_CALLBACK(cb_feedAppSrc), this);
+        g_signal_connect(appSrc, "seek-data", G_CALLBACK(cb_seekAppSrc), this);
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -71,29 +255,113 @@ bool StreamReader::streamSeekable() const
     return m_seekable;
 }
 
+bool StreamReader::isPushMode() const
+{
+    return m_appSrc;
+}
+
+int StreamReader::lowWatermark() const
+{
+    if (!m_marksInMSec) {
+        return m_lowMark;
+    }
+    if (!m_bitrate) {
+        return DEFAULT_LOW_WATERMARK;
+    }
+    return qint64(m_lowMark) * m_bitrate / 8000;
+}
+
+int StreamReader::highWatermark() const
+{
+    if (!m_marksInMSec) {
+        return m_highMark;
+    }
+    if (!m_bitrate) {
+        return DEFAULT_HIGH_WATERMARK;
+    }
+    return qMax<qint64>(qint64(m_highMark) * m_bitrate / 8000, lowWatermark() + 1);
+}
+
+bool StreamReader::partialReads() const
+{
+    return m_partialMinChunk > 0 || m_partialTimeout > 0;
+}
+
+quint64 StreamReader::cacheHits() const
+{
+    return m_cacheHits;
+}
+
+quint64 StreamReader::cacheMisses() const
+{
+    return m_cacheMisses;
+}
+
+quint64 StreamReader::dataRequests() const
+{
+    return m_dataRequests;
+}
+
+qint64 StreamReader::lockWaitTime() const
+{
+    return m_lockWaitTime;
+}
+
+qint64 StreamReader::dataWaitTime() const
+{
+    return m_dataWaitTime;
+}
+
 //------------------------------------------------------------------------------
 // Explicit thread safe through locking the mutex ------------------------------
 //------------------------------------------------------------------------------
 
 void StreamReader::setCurrentPos(qint64 pos)
 {
+    // The frontend stream only gets seeked once read() finds neither the
+    // cache nor the buffer can serve the new position.
     QMutexLocker locker(&m_mutex);
     m_pos = pos;
-    seekStream(pos);
-    m_buffer.clear();
 }
 
 void StreamReader::writeData(const QByteArray &data)
 {
+    QMutexLocker pushLocker(&m_pushMutex);
     QMutexLocker locker(&m_mutex);
     Debug::Block block(__PRETTY_FUNCTION__);
-    m_buffer.append(data);
-    m_waitingForData.wakeAll();
+    if (!m_pushing) {
+        m_buffer.append(data);
+        m_answered = true;
+        if (m_buffer.isFull() && m_requesting) {
+            // The ring does not grow, hold the producer off until read()
+            // made room again.
+            m_requesting = false;
+            enoughData();
+        }
+        m_waitingForData.wakeAll();
+        return;
+    }
+
+    if (!m_locked || data.isEmpty()) {
+        return;
+    }
+    GstBuffer *buf = gst_buffer_new();
+    GST_BUFFER_OFFSET(buf) = m_pos;
+    gst_buffer_append_memory(buf, wrapChunk(data, 0, data.size()));
+    m_pos += data.size();
+    locker.unlock();
+    // Never blocks, the appsrc is not in blocking mode in push mode and
+    // tells us through enough-data once its queue is full. That signal
+    // comes from within push_buffer and takes m_mutex, so push without it.
+    gst_app_src_push_buffer(m_appSrc, buf);
 }
 
-GstFlowReturn StreamReader::read(quint64 pos, int length, char *buffer)
+GstFlowReturn StreamReader::read(quint64 pos, int length, GstBuffer **buffer)
 {
+    QElapsedTimer waiting;
+    waiting.start();
     QMutexLocker locker(&m_mutex);
+    m_lockWaitTime += waiting.nsecsElapsed();
     DEBUG_BLOCK;
 
     // If we got unlocked before grabbing the mutex -> return
@@ -105,48 +373,287 @@ GstFlowReturn StreamReader::read(quint64 pos, int length, char *buffer)
         if (!streamSeekable()) {
             return GST_FLOW_NOT_SUPPORTED;
         }
-        // TODO: technically an error can occur here, however the abstractstream
-        // API does not consider this, so we must assume that everything always goes
-        // alright and continue processing.
-        setCurrentPos(pos);
+        m_pos = pos;
+    }
+
+    // Sequential reads are served by the buffer, only positions away from it
+    // go through the seek-range cache.
+    if (m_seekable && m_cacheLimit > 0 && m_pos != m_bufferPos) {
+        if (GstBuffer *cached = cacheLookup(m_pos, length)) {
+            ++m_cacheHits;
+            m_pos += gst_buffer_get_size(cached);
+            *buffer = cached;
+            return GST_FLOW_OK;
+        }
+        ++m_cacheMisses;
+    }
+
+    if (m_pos != m_bufferPos) {
+        if (m_pos > m_bufferPos && m_pos <= m_bufferPos + currentBufferSize()) {
+            // Forward within what we already got, e.g. after serving from the cache.
+            m_buffer.skip(m_pos - m_bufferPos);
+        } else {
+            // TODO: technically an error can occur here, however the abstractstream
+            // API does not consider this, so we must assume that everything always goes
+            // alright and continue processing.
+            seekStream(m_pos);
+            m_buffer.clear();
+            m_eos = false;
+            m_requesting = false;
+            m_answered = false;
+        }
+        m_bufferPos = m_pos;
     }
 
-    while (currentBufferSize() < length) {
-        int oldSize = currentBufferSize();
-        needData();
+    waiting.restart();
+    while (currentBufferSize() < length && !m_eos) {
+        if (partialReads() && !m_buffer.isEmpty()) {
+            if ((m_partialMinChunk > 0 && currentBufferSize() >= m_partialMinChunk) ||
+                (m_partialTimeout > 0 && waiting.hasExpired(m_partialTimeout))) {
+                // Go with what we have, appsrc is fine with short buffers.
+                break;
+            }
+        }
+
+        if (!m_requesting || m_answered) {
+            m_requesting = true;
+            m_answered = false;
+            requestData();
+        }
 
-        m_waitingForData.wait(&m_mutex);
+        const qint64 waited = waiting.nsecsElapsed();
+        if (m_partialTimeout > 0 && !waiting.hasExpired(m_partialTimeout)) {
+            m_waitingForData.wait(&m_mutex, m_partialTimeout - waiting.elapsed());
+        } else {
+            m_waitingForData.wait(&m_mutex);
+        }
+        m_dataWaitTime += waiting.nsecsElapsed() - waited;
 
         // Abort instantly if we got unlocked, whether we got sufficient data or not
         // is absolutely unimportant at this point.
         if (!m_locked) {
             return GST_FLOW_EOS;
         }
+    }
 
-        if (oldSize == currentBufferSize()) {
-            // We didn't get any data, check if we are at the end of stream already.
-            if (m_eos) {
-                return GST_FLOW_EOS;
+    // At the end of the stream whatever is left gets delivered as a short buffer.
+    if (m_buffer.isEmpty()) {
+        return GST_FLOW_EOS;
+    }
+    *buffer = takeBuffer(qMin(length, currentBufferSize()));
+    if (m_seekable && m_cacheLimit > 0) {
+        cacheInsert(*buffer);
+    }
+    updateDataRequest();
+    return GST_FLOW_OK;
+}
+
+/*
+ * Returns a buffer for [pos, pos + length) made up from cached ranges, or 0 if
+ * the cache does not cover all of it. Close to the end of a stream of known
+ * size the range is cut short the way a real read would be. The returned buffer
+ * shares the memory of the cached ones.
+ */
+GstBuffer *StreamReader::cacheLookup(quint64 pos, int length)
+{
+    if (m_size > 0) {
+        if (pos >= m_size) {
+            return 0;
+        }
+        length = qMin<quint64>(length, m_size - pos);
+    }
+
+    GstBuffer *result = 0;
+    quint64 current = pos;
+    const quint64 end = pos + length;
+    while (current < end) {
+        // Last entry starting at or before current.
+        QMap<quint64, CacheEntry>::iterator it = m_cache.upperBound(current);
+        if (it == m_cache.begin()) {
+            break;
+        }
+        --it;
+        const quint64 entryEnd = it.key() + gst_buffer_get_size(it->buffer);
+        if (entryEnd <= current) {
+            break;
+        }
+        const gsize size = qMin(entryEnd, end) - current;
+        GstBuffer *region = gst_buffer_copy_region(it->buffer, GST_BUFFER_COPY_MEMORY,
+                                                   current - it.key(), size);
+        result = result ? gst_buffer_append(result, region) : region;
+        touchCacheEntry(it);
+        current += size;
+    }
+
+    if (current < end) {
+        if (result) {
+            gst_buffer_unref(result);
+        }
+        return 0;
+    }
+    GST_BUFFER_OFFSET(result) = pos;
+    return result;
+}
+
+void StreamReader::cacheInsert(GstBuffer *buffer)
+{
+    const quint64 offset = GST_BUFFER_OFFSET(buffer);
+    const int size = gst_buffer_get_size(buffer);
+    if (size > m_cacheLimit) {
+        return;
+    }
+
+    QMap<quint64, CacheEntry>::iterator it = m_cache.find(offset);
+    if (it != m_cache.end()) {
+        removeCacheEntry(it);
+    }
+    // Charged up front, it may share its chunks with cached entries. Buffers
+    // only GStreamer still holds on to are not ours to evict, and do not
+    // count.
+    chargeCacheEntry(buffer, true);
+    while (m_cacheBytes > m_cacheLimit && !m_cacheUsage.isEmpty()) {
+        // Least recently used goes first.
+        removeCacheEntry(m_cache.find(m_cacheUsage.begin().value()));
+    }
+    if (m_cacheBytes > m_cacheLimit) {
+        chargeCacheEntry(buffer, false);
+        return;
+    }
+
+    CacheEntry entry;
+    entry.buffer = gst_buffer_ref(buffer);
+    entry.lastUse = ++m_cacheClock;
+    m_cache.insert(offset, entry);
+    m_cacheUsage.insert(entry.lastUse, offset);
+}
+
+void StreamReader::touchCacheEntry(QMap<quint64, CacheEntry>::iterator it)
+{
+    m_cacheUsage.remove(it->lastUse);
+    it->lastUse = ++m_cacheClock;
+    m_cacheUsage.insert(it->lastUse, it.key());
+}
+
+/*
+ * Cached ranges wrap whole writeData() chunks, so a small range keeps its
+ * entire chunk alive. Each distinct chunk is charged with its full size for
+ * as long as any cache entry refers to it.
+ */
+void StreamReader::chargeCacheEntry(GstBuffer *buffer, bool charge)
+{
+    const guint count = gst_buffer_n_memory(buffer);
+    for (guint i = 0; i < count; ++i) {
+        GstMemory *memory = gst_buffer_peek_memory(buffer, i);
+        gsize offset;
+        gsize maxSize;
+        gst_memory_get_sizes(memory, &offset, &maxSize);
+        GstMapInfo info;
+        if (!gst_memory_map(memory, &info, GST_MAP_READ)) {
+            continue;
+        }
+        // Shared regions of a chunk all start from the same data.
+        const guint8 *chunk = info.data - offset;
+        gst_memory_unmap(memory, &info);
+        if (charge) {
+            if (m_cacheChunks[chunk]++ == 0) {
+                m_cacheBytes += maxSize;
+            }
+        } else {
+            QHash<const guint8 *, int>::iterator it = m_cacheChunks.find(chunk);
+            if (it != m_cacheChunks.end() && --it.value() == 0) {
+                m_cacheChunks.erase(it);
+                m_cacheBytes -= maxSize;
             }
         }
     }
-    if (m_pipeline->phononState() != Phonon::BufferingState &&
-        m_pipeline->phononState() != Phonon::LoadingState) {
-        enoughData();
+}
+
+void StreamReader::removeCacheEntry(QMap<quint64, CacheEntry>::iterator it)
+{
+    m_cacheUsage.remove(it->lastUse);
+    chargeCacheEntry(it->buffer, false);
+    gst_buffer_unref(it->buffer);
+    m_cache.erase(it);
+}
+
+void StreamReader::clearCache()
+{
+    foreach (const CacheEntry &entry, m_cache) {
+        gst_buffer_unref(entry.buffer);
+    }
+    m_cache.clear();
+    m_cacheUsage.clear();
+    m_cacheChunks.clear();
+    m_cacheBytes = 0;
+}
+
+/*
+ * Hysteresis for the requests to the frontend: once the buffer drained below
+ * the low watermark we keep asking for data until it is filled above the high
+ * watermark or the ring buffer ran out of slots, in between the frontend is
+ * left alone. A request is only repeated once the previous one got answered,
+ * so producers that write a single chunk per needData() keep going while push
+ * style producers are not spammed.
+ */
+void StreamReader::updateDataRequest()
+{
+    if (m_eos) {
+        return;
     }
+    const int size = currentBufferSize();
+    if (m_requesting) {
+        if (size >= highWatermark() || m_buffer.isFull()) {
+            m_requesting = false;
+            enoughData();
+        } else if (m_answered) {
+            m_answered = false;
+            requestData();
+        }
+    } else if (size < lowWatermark() && !m_buffer.isFull()) {
+        m_requesting = true;
+        m_answered = false;
+        requestData();
+    }
+}
+
+void StreamReader::requestData()
+{
+    ++m_dataRequests;
+    needData();
+}
 
-    memcpy(buffer, m_buffer.data(), length);
+/*
+ * Moves length buffered bytes into a new GstBuffer. The chunks we got from
+ * writeData() are handed to GStreamer as they are.
+ */
+GstBuffer *StreamReader::takeBuffer(int length)
+{
+    GstBuffer *buf = gst_buffer_new();
+    GST_BUFFER_OFFSET(buf) = m_pos;
+    int remaining = length;
+    while (remaining > 0) {
+        QByteArray chunk;
+        int offset = 0;
+        const int size = m_buffer.takeChunk(remaining, &chunk, &offset);
+        gst_buffer_append_memory(buf, wrapChunk(chunk, offset, size));
+        remaining -= size;
+    }
     m_pos += length;
-    //truncate the buffer
-    m_buffer = m_buffer.mid(length);
-    return GST_FLOW_OK;
+    m_bufferPos += length;
+    return buf;
 }
 
 void StreamReader::endOfData()
 {
+    QMutexLocker pushLocker(&m_pushMutex);
     QMutexLocker locker(&m_mutex);
     m_eos = true;
     m_waitingForData.wakeAll();
+    const bool push = m_pushing && m_locked;
+    locker.unlock();
+    if (push) {
+        gst_app_src_end_of_stream(m_appSrc);
+    }
 }
 
 void StreamReader::start()
@@ -159,6 +666,16 @@ void StreamReader::start()
     m_pos = 0;
     m_seekable = false;
     m_size = 0;
+    m_pushing = false;
+    m_requesting = false;
+    m_answered = false;
+    m_bufferPos = 0;
+    clearCache();
+    m_cacheHits = 0;
+    m_cacheMisses = 0;
+    m_dataRequests = 0;
+    m_lockWaitTime = 0;
+    m_dataWaitTime = 0;
     reset();
 }
 
@@ -168,6 +685,14 @@ void StreamReader::stop()
     DEBUG_BLOCK;
     if (!m_eos)
         enoughData();
+    if (m_cacheHits || m_cacheMisses) {
+        debug() << "Seek-range cache hits:" << m_cacheHits << "misses:" << m_cacheMisses;
+    }
+    if (m_dataRequests || m_lockWaitTime || m_dataWaitTime) {
+        debug() << "Data requests:" << m_dataRequests
+                << "lock wait:" << m_lockWaitTime / 1000000 << "ms"
+                << "data wait:" << m_dataWaitTime / 1000000 << "ms";
+    }
     m_locked = false;
     m_waitingForData.wakeAll();
 }
@@ -184,6 +709,117 @@ void StreamReader::setStreamSeekable(bool seekable)
     m_seekable = seekable;
 }
 
+void StreamReader::setPushMode(GstAppSrc *appSrc)
+{
+    QMutexLocker pushLocker(&m_pushMutex);
+    QMutexLocker locker(&m_mutex);
+    if (m_appSrc) {
+        gst_object_unref(m_appSrc);
+    }
+    m_appSrc = GST_APP_SRC(gst_object_ref(appSrc));
+    m_pushing = false;
+    applyAppSrcWatermarks();
+}
+
+void StreamReader::setWatermarks(int low, int high, bool inMSec)
+{
+    QMutexLocker locker(&m_mutex);
+    m_lowMark = low;
+    m_highMark = high;
+    m_marksInMSec = inMSec;
+    applyAppSrcWatermarks();
+}
+
+void StreamReader::setPartialReads(int minChunk, int timeout)
+{
+    QMutexLocker locker(&m_mutex);
+    m_partialMinChunk = qMax(minChunk, 0);
+    m_partialTimeout = qMax(timeout, 0);
+}
+
+void StreamReader::setBitrate(quint32 bitsPerSecond)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_bitrate == bitsPerSecond) {
+        return;
+    }
+    m_bitrate = bitsPerSecond;
+    if (m_marksInMSec) {
+        debug() << "Stream watermarks now" << lowWatermark() << highWatermark() << "bytes";
+        applyAppSrcWatermarks();
+    }
+}
+
+/*
+ * In push mode the appsrc queue does the buffering, so our watermarks become
+ * its maximum fill level and the level below which it emits need-data.
+ */
+void StreamReader::applyAppSrcWatermarks()
+{
+    if (!m_appSrc) {
+        return;
+    }
+    const int high = highWatermark();
+    g_object_set(m_appSrc,
+                 "max-bytes", (guint64) high,
+                 "min-percent", (guint) (qint64(lowWatermark()) * 100 / high),
+                 NULL);
+}
+
+void StreamReader::setDataWanted(bool wanted)
+{
+    if (!wanted) {
+        // appsrc emits enough-data from within push_buffer, which is only
+        // ever called with m_mutex released.
+        QMutexLocker locker(&m_mutex);
+        const bool notify = m_locked && !m_eos;
+        locker.unlock();
+        if (notify) {
+            enoughData();
+        }
+        return;
+    }
+
+    // Keeps writeData() from pushing ahead of what got buffered so far.
+    QMutexLocker pushLocker(&m_pushMutex);
+    QMutexLocker locker(&m_mutex);
+    if (!m_locked) {
+        return;
+    }
+
+    // Until the appsrc asked for data for the first time it is not started
+    // and would drop anything we push, so everything written so far got
+    // buffered and goes out now.
+    GstBuffer *buffered = 0;
+    bool flushEos = false;
+    if (!m_pushing) {
+        m_pushing = true;
+        if (!m_buffer.isEmpty()) {
+            buffered = takeBuffer(m_buffer.size());
+        }
+        flushEos = m_eos;
+    }
+    const bool eos = m_eos;
+    if (!eos) {
+        ++m_dataRequests;
+    }
+    locker.unlock();
+
+    if (buffered) {
+        gst_app_src_push_buffer(m_appSrc, buffered);
+    }
+    if (flushEos) {
+        gst_app_src_end_of_stream(m_appSrc);
+    }
+    pushLocker.unlock();
+
+    if (eos) {
+        return;
+    }
+    // The frontend is free to call writeData() from within needData().
+    needData();
+}
+
 }
 }
 #endif //QT_NO_PHONON_ABSTRACTMEDIASTREAM
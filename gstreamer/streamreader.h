@@ -19,20 +19,22 @@
 #ifndef PHONON_GSTREAMER_STREAMREADER_H
 #define PHONON_GSTREAMER_STREAMREADER_H
 
+#include <phonon/MediaSource>
 #include <phonon/streaminterface.h>
 
+#include <QtCore/QHash>
+#include <QtCore/QMap>
 #include <QtCore/QMutex>
 #include <QtCore/QWaitCondition>
 
-#include "mediaobject.h"
+#include <gst/app/gstappsrc.h>
+
+#include "streambuffer.h"
 
 #ifndef QT_NO_PHONON_ABSTRACTMEDIASTREAM
 
 namespace Phonon
 {
-
-class MediaSource;
-
 namespace Gstreamer
 {
 
@@ -41,15 +43,22 @@ class StreamReader : public QObject, Phonon::StreamInterface
     Q_INTERFACES(Phonon::StreamInterface);
     Q_OBJECT
 public:
-    StreamReader(const Phonon::MediaSource &source, Pipeline *parent);
+    explicit StreamReader(const Phonon::MediaSource &source);
     ~StreamReader();
 
+    /*
+     * Configures the appsrc for the stream and routes its signals to the
+     * reader, seekable streams get pulled through read() and all others are
+     * pushed, see setPushMode().
+     */
+    void setupAppSrc(GstAppSrc *appSrc);
+
     /*
      * Overloads for StreamInterface
      */
     int currentBufferSize() const;
     void writeData(const QByteArray &data) Q_DECL_OVERRIDE;
-    GstFlowReturn read(quint64 offset, int length, char * buffer);
+    GstFlowReturn read(quint64 offset, int length, GstBuffer **buffer);
 
     bool atEnd() const;
 
@@ -66,15 +75,108 @@ public:
     void setStreamSeekable(bool seekable) Q_DECL_OVERRIDE;
     bool streamSeekable() const;
 
+    /*
+     * In push mode data is forwarded to the appsrc as soon as writeData()
+     * delivers it, instead of being buffered until the appsrc asks for it
+     * through read(). Backpressure is left to appsrc's need-data and
+     * enough-data signals, which have to be routed to setDataWanted().
+     */
+    void setPushMode(GstAppSrc *appSrc);
+    bool isPushMode() const;
+    void setDataWanted(bool wanted);
+
+    /*
+     * The frontend is asked for data once the buffer drops below the low
+     * watermark and told to stop once it is filled above the high watermark.
+     * Watermarks are given in bytes, or in milliseconds of the stream which
+     * get converted using the stream bitrate once it is known.
+     */
+    void setWatermarks(int low, int high, bool inMSec = false);
+    void setBitrate(quint32 bitsPerSecond);
+    int lowWatermark() const;
+    int highWatermark() const;
+
+    /*
+     * Seekable streams keep recently read ranges in a bounded LRU cache, so
+     * that demuxers probing the same ranges again, e.g. an index at the end of
+     * the file, do not cause a round-trip to the frontend stream every time.
+     */
+    quint64 cacheHits() const;
+    quint64 cacheMisses() const;
+
+    /*
+     * By default read() waits until the full requested length is buffered.
+     * With partial reads it returns whatever is buffered as soon as minChunk
+     * bytes are available or timeout milliseconds passed, whichever comes
+     * first, so a slow producer does not delay the first decoded sample.
+     * A value of 0 disables the respective condition.
+     */
+    void setPartialReads(int minChunk, int timeout);
+    bool partialReads() const;
+
+    /*
+     * Counters since the last start(): the number of needData() requests sent
+     * to the frontend, and the nanoseconds read() spent waiting for the mutex
+     * and for the frontend to deliver data.
+     */
+    quint64 dataRequests() const;
+    qint64 lockWaitTime() const;
+    qint64 dataWaitTime() const;
+
 private:
+    struct CacheEntry {
+        GstBuffer *buffer;
+        quint64 lastUse;
+    };
+
+    GstBuffer *cacheLookup(quint64 pos, int length);
+    void cacheInsert(GstBuffer *buffer);
+    void chargeCacheEntry(GstBuffer *buffer, bool charge);
+    void touchCacheEntry(QMap<quint64, CacheEntry>::iterator it);
+    void removeCacheEntry(QMap<quint64, CacheEntry>::iterator it);
+    void clearCache();
+
+    GstBuffer *takeBuffer(int length);
+    void requestData();
+    void updateDataRequest();
+    void applyAppSrcWatermarks();
+
     quint64 m_pos;
     quint64 m_size;
     bool m_eos;
     bool m_locked;
     bool m_seekable;
-    Pipeline *m_pipeline;
-    QByteArray m_buffer;
+    GstAppSrc *m_appSrc;
+    bool m_pushing;
+    int m_lowMark;
+    int m_highMark;
+    bool m_marksInMSec;
+    quint32 m_bitrate;
+    // Whether needData() was issued and not yet revoked with enoughData().
+    bool m_requesting;
+    // Whether writeData() delivered anything since the last needData().
+    bool m_answered;
+    // Stream offset of the first byte in m_buffer.
+    quint64 m_bufferPos;
+    // Cached ranges by stream offset, and their offsets by last use.
+    QMap<quint64, CacheEntry> m_cache;
+    QMap<quint64, quint64> m_cacheUsage;
+    int m_cacheLimit;
+    // Cache entries per chunk they wrap, and the full size of those chunks.
+    QHash<const guint8 *, int> m_cacheChunks;
+    qint64 m_cacheBytes;
+    quint64 m_cacheClock;
+    quint64 m_cacheHits;
+    quint64 m_cacheMisses;
+    int m_partialMinChunk;
+    int m_partialTimeout;
+    quint64 m_dataRequests;
+    qint64 m_lockWaitTime;
+    qint64 m_dataWaitTime;
+    StreamBuffer m_buffer;
     QMutex m_mutex;
+    // Orders pushes into the appsrc, which happen with m_mutex released.
+    QMutex m_pushMutex;
     QWaitCondition m_waitingForData;
 };
 
@@ -0,0 +1,291 @@
+/*  This file is part of the KDE project.
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2.1 or 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "threadpolicy.h"
+#include "debug.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define THREAD_CLASS_KEY "phonon-gst-thread-class"
+#define CATEGORY_KEY "phonon-gst-category"
+
+// What apply() found on the calling thread, for restore() to put back.
+struct SavedThreadState
+{
+    bool scheduler;
+    bool nice;
+    bool cpus;
+#ifdef Q_OS_UNIX
+    int policy;
+    sched_param param;
+#endif
+#ifdef Q_OS_LINUX
+    int niceLevel;
+    cpu_set_t cpuSet;
+#endif
+};
+static thread_local SavedThreadState s_saved = SavedThreadState();
+
+namespace Phonon
+{
+namespace Gstreamer
+{
+
+struct Policy
+{
+    Policy()
+        : scheduler(-1)
+        , priority(0)
+        , nice(0)
+        , setNice(false)
+    {
+    }
+
+    // SCHED_FIFO or SCHED_RR, -1 to leave the scheduler alone.
+    int scheduler;
+    int priority;
+    int nice;
+    bool setNice;
+    QList<int> cpus;
+};
+
+static QByteArray className(ThreadPolicy::ThreadClass threadClass)
+{
+    switch (threadClass) {
+    case ThreadPolicy::AudioThread:
+        return "AUDIO";
+    case ThreadPolicy::VideoThread:
+        return "VIDEO";
+    case ThreadPolicy::AnalysisThread:
+        return "ANALYSIS";
+    case ThreadPolicy::NoThreadClass:
+        break;
+    }
+    return QByteArray();
+}
+
+static QByteArray categoryName(int category)
+{
+    switch (category) {
+    case Phonon::NotificationCategory:
+        return "NOTIFICATION";
+    case Phonon::MusicCategory:
+        return "MUSIC";
+    case Phonon::VideoCategory:
+        return "VIDEO";
+    case Phonon::CommunicationCategory:
+        return "COMMUNICATION";
+    case Phonon::GameCategory:
+        return "GAME";
+    case Phonon::AccessibilityCategory:
+        return "ACCESSIBILITY";
+    }
+    return QByteArray();
+}
+
+static Policy parsePolicy(const QByteArray &spec)
+{
+    Policy policy;
+    QByteArray rule = spec.trimmed();
+    const int at = rule.indexOf('@');
+    if (at >= 0) {
+        foreach (const QByteArray &cpu, rule.mid(at + 1).split(',')) {
+            bool ok;
+            const int index = cpu.trimmed().toInt(&ok);
+#ifdef Q_OS_LINUX
+            // CPU_SET() does not check its index.
+            ok = ok && index < CPU_SETSIZE;
+#endif
+            if (ok && index >= 0) {
+                policy.cpus << index;
+            } else {
+                warning() << "Invalid CPU" << cpu.trimmed() << "in thread policy" << spec;
+            }
+        }
+        rule.truncate(at);
+    }
+    const QList<QByteArray> parts = rule.split(':');
+    const QByteArray kind = parts.first().toLower();
+    const int value = parts.size() > 1 ? parts.at(1).toInt() : 0;
+    if (kind == "fifo" || kind == "rr") {
+#ifdef Q_OS_UNIX
+        policy.scheduler = kind == "fifo" ? SCHED_FIFO : SCHED_RR;
+        policy.priority = value;
+#endif
+    } else if (kind == "nice") {
+        policy.setNice = true;
+        policy.nice = value;
+    } else if (!kind.isEmpty() && kind != "none") {
+        warning() << "Unknown thread policy" << spec;
+    }
+    return policy;
+}
+
+static Policy policyFor(ThreadPolicy::ThreadClass threadClass, int category)
+{
+    static QMutex mutex;
+    static QHash<QByteArray, Policy> cache;
+
+    QByteArray key = "PHONON_GST_THREAD_POLICY_" + className(threadClass);
+    const QByteArray categoryKey = key + '_' + categoryName(category);
+    if (!categoryName(category).isEmpty() && qEnvironmentVariableIsSet(categoryKey.constData())) {
+        key = categoryKey;
+    }
+
+    QMutexLocker locker(&mutex);
+    QHash<QByteArray, Policy>::const_iterator it = cache.constFind(key);
+    if (it != cache.constEnd()) {
+        return it.value();
+    }
+    // Threads are left alone unless asked for.
+    const Policy policy = parsePolicy(qgetenv(key.constData()));
+    cache.insert(key, policy);
+    return policy;
+}
+
+void ThreadPolicy::tag(GstElement *element, ThreadClass threadClass)
+{
+    g_object_set_data(G_OBJECT(element), THREAD_CLASS_KEY, GINT_TO_POINTER(threadClass));
+}
+
+void ThreadPolicy::tagCategory(GstElement *element, Phonon::Category category)
+{
+    // Offset so that NoCategory is not mistaken for a missing tag.
+    g_object_set_data(G_OBJECT(element), CATEGORY_KEY, GINT_TO_POINTER(category + 2));
+}
+
+void ThreadPolicy::apply(GstElement *owner)
+{
+    ThreadClass threadClass = NoThreadClass;
+    int category = 0;
+    // Tags of the innermost bin win, a data output inside the audio graph
+    // runs analysis threads.
+    for (GstObject *object = GST_OBJECT(owner); object; object = GST_OBJECT_PARENT(object)) {
+        if (threadClass == NoThreadClass) {
+            threadClass = ThreadClass(GPOINTER_TO_INT(g_object_get_data(G_OBJECT(object), THREAD_CLASS_KEY)));
+        }
+        if (!category) {
+            category = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(object), CATEGORY_KEY));
+        }
+    }
+    if (threadClass == NoThreadClass) {
+        return;
+    }
+    const Policy policy = policyFor(threadClass, category - 2);
+
+    // Only warn once per kind, every thread would fail the same way.
+    static QAtomicInt schedulerWarned;
+    static QAtomicInt niceWarned;
+    static QAtomicInt cpusWarned;
+#ifdef Q_OS_UNIX
+    if (policy.scheduler >= 0 && !s_saved.scheduler
+            && !pthread_getschedparam(pthread_self(), &s_saved.policy, &s_saved.param)) {
+        sched_param param;
+        param.sched_priority = policy.priority;
+        const int err = pthread_setschedparam(pthread_self(), policy.scheduler, &param);
+        if (!err) {
+            s_saved.scheduler = true;
+        } else if (schedulerWarned.testAndSetRelaxed(0, 1)) {
+            warning() << "Could not set real-time priority of streaming threads:" << strerror(err);
+        }
+    }
+#endif
+#ifdef Q_OS_LINUX
+    // Per thread on Linux, the thread id stands in for the process.
+    const id_t tid = syscall(SYS_gettid);
+    if (policy.setNice && !s_saved.nice) {
+        errno = 0;
+        const int niceLevel = getpriority(PRIO_PROCESS, tid);
+        if (!errno) {
+            if (!setpriority(PRIO_PROCESS, tid, policy.nice)) {
+                s_saved.nice = true;
+                s_saved.niceLevel = niceLevel;
+            } else if (niceWarned.testAndSetRelaxed(0, 1)) {
+                warning() << "Could not set the nice level of streaming threads:" << strerror(errno);
+            }
+        }
+    }
+    if (!policy.cpus.isEmpty() && !s_saved.cpus) {
+        if (!pthread_getaffinity_np(pthread_self(), sizeof(s_saved.cpuSet), &s_saved.cpuSet)) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            foreach (int cpu, policy.cpus) {
+                CPU_SET(cpu, &cpus);
+            }
+            const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (!err) {
+                s_saved.cpus = true;
+            } else if (cpusWarned.testAndSetRelaxed(0, 1)) {
+                warning() << "Could not pin streaming threads:" << strerror(err);
+            }
+        }
+    }
+#endif
+}
+
+void ThreadPolicy::restore()
+{
+    static QAtomicInt schedulerWarned;
+    static QAtomicInt niceWarned;
+    static QAtomicInt cpusWarned;
+#ifdef Q_OS_UNIX
+    if (s_saved.scheduler) {
+        s_saved.scheduler = false;
+        const int err = pthread_setschedparam(pthread_self(), s_saved.policy, &s_saved.param);
+        if (err && schedulerWarned.testAndSetRelaxed(0, 1)) {
+            warning() << "Could not restore the scheduling of a streaming thread:" << strerror(err);
+        }
+    }
+#endif
+#ifdef Q_OS_LINUX
+    if (s_saved.nice) {
+        s_saved.nice = false;
+        // Going back below a raised nice level needs privileges the process
+        // may lack, the thread then stays at the level it was given.
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), s_saved.niceLevel)
+                && niceWarned.testAndSetRelaxed(0, 1)) {
+            warning() << "Could not restore the nice level of a streaming thread:" << strerror(errno);
+        }
+    }
+    if (s_saved.cpus) {
+        s_saved.cpus = false;
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(s_saved.cpuSet), &s_saved.cpuSet);
+        if (err && cpusWarned.testAndSetRelaxed(0, 1)) {
+            warning() << "Could not restore the CPUs of a streaming thread:" << strerror(err);
+        }
+    }
+#endif
+}
+}
@@ -0,0 +1,73 @@
+/*  This file is part of the KDE project.
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2.1 or 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PHONON_GSTREAMER_THREADPOLICY_H
+#define PHONON_GSTREAMER_THREADPOLICY_H
+
+#include <phonon/phononnamespace.h>
+
+#include <gst/gst.h>
+
+namespace Phonon
+{
+namespace Gstreamer
+{
+
+/*
+ * Scheduling policy of the streaming threads, applied by the thread itself
+ * when it enters its loop.
+ *
+ * Nodes tag their bins with the kind of threads they run, audio outputs also
+ * with their category. The policy of each kind is read from the environment,
+ * e.g.
+ *
+ *     PHONON_GST_THREAD_POLICY_AUDIO=rr:10@2,3
+ *     PHONON_GST_THREAD_POLICY_AUDIO_COMMUNICATION=fifo:20
+ *     PHONON_GST_THREAD_POLICY_VIDEO=nice:2
+ *     PHONON_GST_THREAD_POLICY_ANALYSIS=none
+ *
+ * where fifo and rr select real-time scheduling at the given priority, nice
+ * a nice level and the optional list after @ the CPUs to pin the thread to.
+ * Threads of kinds without a policy are left alone, policies the process is
+ * not privileged for only produce a warning.
+ */
+class ThreadPolicy
+{
+public:
+    enum ThreadClass {
+        NoThreadClass,
+        AudioThread,
+        VideoThread,
+        // Data outputs, which must not get in the way of playback.
+        AnalysisThread
+    };
+
+    static void tag(GstElement *element, ThreadClass threadClass);
+    static void tagCategory(GstElement *element, Phonon::Category category);
+
+    // Applies the policy for owner to the calling thread, elements without a
+    // tagged ancestor are left alone.
+    static void apply(GstElement *owner);
+    // Puts back the scheduling, nice level and CPUs the thread had before
+    // apply() once it leaves its loop.
+    static void restore();
+};
+
+}
+}
+
+#endif // PHONON_GSTREAMER_THREADPOLICY_H
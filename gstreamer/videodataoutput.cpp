@@ -21,6 +21,7 @@
 */
 
 #include "videodataoutput.h"
+#include "threadpolicy.h"
 #include <phonon/experimental/videoframe2.h>
 #include "phonon-config-gstreamer.h"
 
@@ -45,6 +46,7 @@ VideoDataOutput::VideoDataOutput(Backend *backend, QObject *parent)
 
     m_queue = gst_bin_new(NULL);
     gst_object_ref_sink(GST_OBJECT(m_queue));
+    ThreadPolicy::tag(m_queue, ThreadPolicy::AnalysisThread);
 
     GstElement* sink = gst_element_factory_make("fakesink", NULL);
     GstElement* queue = gst_element_factory_make("queue", NULL);